@@ -16,18 +16,143 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-// Audio format: signed 8-bit PWM.
+// Audio format: signed 8-bit PWM, optionally in a WAV file.
 
+#define _GNU_SOURCE // O_DIRECT
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 #define DEFAULT_SAMPLE_RATE 48000
 #define DEFAULT_PX_PER_MIN 240
+#define DEFAULT_FFT_SIZE 2048
+// --preview renders at the rate divided by this
+#define PREVIEW_DIVISOR 16
+// highest pitch a preview plays, as a fraction of its rate
+#define PREVIEW_MAX_PITCH 0.4
+#define NUM_KEYS 88
+
+// The synthesis and conversion kernels are built once for each x86-64 level,
+// and the loader picks the best one the CPU supports when the program starts.
+// A build with -march for one CPU (as tool-native is) defines NO_KERNEL_CLONES,
+// since its helpers could not be inlined into the builds for other levels.
+#if defined(__x86_64__) && defined(__GNUC__) && __GNUC__ >= 12 && !defined(__clang__) \
+        && !defined(NO_KERNEL_CLONES)
+#define KERNEL __attribute__((target_clones("default", "arch=x86-64-v2", "arch=x86-64-v3", "arch=x86-64-v4")))
+#define KERNEL_CLONES 1
+#else
+#define KERNEL
+#define KERNEL_CLONES 0
+#endif
+
+// which build of the kernels is running, the same choice the loader makes
+const char *dispatch_level(void)
+{
+#if KERNEL_CLONES
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("x86-64-v4"))
+        return "x86-64-v4";
+    if (__builtin_cpu_supports("x86-64-v3"))
+        return "x86-64-v3";
+    if (__builtin_cpu_supports("x86-64-v2"))
+        return "x86-64-v2";
+    return "x86-64 (baseline)";
+#else
+    return "single build";
+#endif
+}
+
+enum {
+    MODE_NOTES,
+    MODE_SPECTROGRAM,
+};
+
+// output sample formats
+enum {
+    FORMAT_S8, // signed 8-bit
+    FORMAT_S16, // signed 16-bit little-endian
+    FORMAT_U8, // unsigned 8-bit, centred on 128
+};
+
+// stereo placement of notes
+enum {
+    PAN_NONE, // mono
+    PAN_PITCH, // low keys left, high keys right
+    PAN_COLOUR, // blue left, green right
+};
+
+// output file types
+enum {
+    CONTAINER_RAW, // samples only
+    CONTAINER_WAV, // WAV, or RF64 past 4 GiB
+    CONTAINER_FLAC, // FLAC, losslessly compressed
+};
+
+// how the volume of a score is set
+enum {
+    NORMALIZE_NONE, // by the most notes in a column
+    NORMALIZE_PEAK, // the loudest column reaches the ceiling
+    NORMALIZE_RMS, // the average level is NORMALIZE_TARGET_RMS
+};
+
+// how the frames of an animated image play
+enum {
+    FRAMES_FIRST, // only the first frame
+    FRAMES_CONCAT, // one after another
+    FRAMES_LAYER, // all at once
+};
+
+// rendering settings shared by process() and the renderers
+struct config {
+    unsigned int rate; // sample rate
+    unsigned int spp; // samples per pixel
+    unsigned int ox; // offset x
+    unsigned int oy; // offset y
+    int mode; // MODE_*
+    unsigned int fft_size; // spectrogram FFT size, a power of 2
+    unsigned int hop; // spectrogram hop size in samples
+    unsigned int max_notes; // polyphony limit, 0 for every key
+    int priority; // PRIORITY_*, which notes to keep over the limit
+    char bandlimit; // use the band-limited oscillators
+    unsigned int oversample; // render notes at this multiple of the rate
+    char fixed; // use the fixed-point synthesis path
+    int wave; // WAVE_* for images without colour
+    int frames; // FRAMES_*
+    const char *cache_dir; // directory for decoded images, or NULL
+    char to_score; // write the notes as a score file instead of audio
+    char verify; // check the render paths against the reference instead of rendering
+    char stream_column; // play one column of each streamed frame
+    size_t block_size; // bytes per output write
+    char direct; // write the output with direct I/O
+    char io_uring; // submit output writes through io_uring
+    int format; // FORMAT_*
+    int container; // CONTAINER_*
+    int pan; // PAN_*
+    char limit; // run the output through the look-ahead limiter
+    unsigned int preview; // a draft with this many times fewer samples, 0 for a full render
+    int normalize; // NORMALIZE_*
+    char envelope; // shape notes with the envelope below
+    float attack, decay, release; // envelope times in seconds
+    float sustain; // envelope sustain level, 0 to 1
+    char v; // verbose flag
+};
 
 enum {
     WAVE_SINE,
@@ -81,6 +206,16 @@ float color_to_amplitude(unsigned char r, unsigned char g, unsigned char b)
     return (float)x / 255.0;
 }
 
+// loudness byte of a pixel with n channels: the biggest colour channel, or
+// the gray level of 1- and 2-channel images
+static inline unsigned char pixel_level(const unsigned char *p, int n)
+{
+    if (n < 3)
+        return p[0];
+    unsigned char x = (p[0] > p[1])? p[0] : p[1];
+    return (x > p[2])? x : p[2];
+}
+
 // choose a waveform based on the color
 // <dominant color → waveform>
 //     red → sine
@@ -95,6 +230,14 @@ int color_to_wave(unsigned char r, unsigned char g, unsigned char b)
     return WAVE_SAW;
 }
 
+// choose a stereo position based on the color: blue pans left and green
+// pans right, by how much one outweighs the other
+// returns -127 (left) to 127 (right), 0 for the centre
+static inline int8_t color_to_pan(unsigned char g, unsigned char b)
+{
+    return (g + b)? 127 * (g - b) / (g + b) : 0;
+}
+
 // o = output buffer
 // w = waveform kind
 // t = time
@@ -134,161 +277,4900 @@ void generate_samples(
     }
 }
 
-int process_check(
-        char *in_filename, char *out_filename, unsigned int rate,
-        unsigned int spp, char v)
+// in-place radix-2 FFT of n complex values (n must be a power of 2)
+// re, im = real and imaginary parts
+// inverse = non-zero for the inverse transform (not scaled by 1/n)
+void fft(float *re, float *im, unsigned int n, int inverse)
+{
+    // bit-reversal permutation
+    for (unsigned int i = 1, j = 0; i < n; i++)
+    {
+        unsigned int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+        {
+            float tr = re[i]; re[i] = re[j]; re[j] = tr;
+            float ti = im[i]; im[i] = im[j]; im[j] = ti;
+        }
+    }
+    // butterflies
+    for (unsigned int len = 2; len <= n; len <<= 1)
+    {
+        double ang = 2 * M_PI / len * (inverse? 1 : -1);
+        float wr = cos(ang), wi = sin(ang);
+        for (unsigned int i = 0; i < n; i += len)
+        {
+            float cr = 1, ci = 0;
+            for (unsigned int k = 0; k < len / 2; k++)
+            {
+                unsigned int a = i + k, b = i + k + len / 2;
+                float xr = re[b] * cr - im[b] * ci;
+                float xi = re[b] * ci + im[b] * cr;
+                re[b] = re[a] - xr;
+                im[b] = im[a] - xi;
+                re[a] += xr;
+                im[a] += xi;
+                float t = cr * wr - ci * wi;
+                ci = cr * wi + ci * wr;
+                cr = t;
+            }
+        }
+    }
+}
+
+// inverse-STFT synthesizer state
+// Each frame is one magnitude spectrum, resynthesized with a phase that
+// advances continuously by bin frequency from frame to frame, windowed and
+// overlap-added into acc.
+struct spectro {
+    unsigned int n; // FFT size
+    unsigned int hop; // samples between frame centers
+    float *window; // Hann window, n values
+    float *rot_re, *rot_im; // e^(2*pi*i*m/n) for m in [0, n)
+    float *phi_re, *phi_im; // per-bin starting phase, n/2 values
+    float *re, *im; // FFT work buffers, n values each
+    float gain; // 1 / overlap-add window gain
+};
+
+int spectro_init(struct spectro *s, unsigned int n, unsigned int hop)
+{
+    memset(s, 0, sizeof(*s));
+    s->n = n;
+    s->hop = hop;
+    s->window = malloc(n * sizeof(float));
+    s->rot_re = malloc(n * sizeof(float));
+    s->rot_im = malloc(n * sizeof(float));
+    s->phi_re = malloc(n / 2 * sizeof(float));
+    s->phi_im = malloc(n / 2 * sizeof(float));
+    s->re = malloc(n * sizeof(float));
+    s->im = malloc(n * sizeof(float));
+    if (!s->window || !s->rot_re || !s->rot_im || !s->phi_re || !s->phi_im
+            || !s->re || !s->im)
+        return 1;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        s->window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / n);
+        s->rot_re[i] = cos(2 * M_PI * i / n);
+        s->rot_im[i] = sin(2 * M_PI * i / n);
+    }
+    // scatter the starting phases so the bins do not all line up into a
+    // click at the start of each frame
+    uint32_t seed = 0x9e3779b9;
+    for (unsigned int k = 0; k < n / 2; k++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        double phi = 2 * M_PI * (seed >> 8) / (double)(1 << 24);
+        s->phi_re[k] = cos(phi);
+        s->phi_im[k] = sin(phi);
+    }
+    // a Hann window overlap-adds to (n/2)/hop
+    s->gain = (float)hop / (n / 2);
+    return 0;
+}
+
+void spectro_free(struct spectro *s)
+{
+    free(s->window);
+    free(s->rot_re);
+    free(s->rot_im);
+    free(s->phi_re);
+    free(s->phi_im);
+    free(s->re);
+    free(s->im);
+}
+
+// synthesize one frame and overlap-add it into o (n samples)
+// mag = bin magnitudes (n/2 values, bin 0 is DC)
+// center = absolute sample position of the frame center
+void spectro_frame(struct spectro *s, const float *mag, float *o, uint64_t center)
+{
+    const unsigned int n = s->n;
+    // sum of squared magnitudes, to keep dense frames from clipping
+    float energy = 0;
+    for (unsigned int k = 1; k < n / 2; k++)
+        energy += mag[k] * mag[k];
+    if (energy == 0)
+        return;
+    float norm = 2 * sqrtf(energy);
+    float g = s->gain / ((norm > 1)? norm : 1);
+    // hermitian spectrum with the phase of each bin at this frame's start
+    const uint64_t start = (center + n / 2) % n;
+    memset(s->re, 0, n * sizeof(float));
+    memset(s->im, 0, n * sizeof(float));
+    for (unsigned int k = 1; k < n / 2; k++)
+    {
+        if (!mag[k])
+            continue;
+        unsigned int m = (k * start) % n;
+        float a = 0.5 * g * mag[k];
+        float pr = s->rot_re[m] * s->phi_re[k] - s->rot_im[m] * s->phi_im[k];
+        float pi = s->rot_re[m] * s->phi_im[k] + s->rot_im[m] * s->phi_re[k];
+        s->re[k] = a * pr;
+        s->im[k] = a * pi;
+        s->re[n - k] = a * pr;
+        s->im[n - k] = -a * pi;
+    }
+    fft(s->re, s->im, n, 1);
+    for (unsigned int i = 0; i < n; i++)
+        o[i] += s->re[i] * s->window[i];
+}
+
+// fractional part of a non-negative x
+// Truncating through an int compiles to a single vector instruction, where
+// floorf() needs SSE4.1 to vectorize at all.
+static inline float frac_pos(float x)
+{
+    return x - (float)(int32_t)x;
+}
+
+// sin(2*pi*x) for non-negative x, by a polynomial that unlike sin() can be
+// vectorized
+static inline float sin_cycles(float x)
+{
+    x = frac_pos(x + 0.5f) - 0.5f; // [-0.5, 0.5)
+    // fold into [-0.25, 0.25], where the series converges quickly
+    const float hi = 0.5f - x, lo = -0.5f - x;
+    x = (hi < x)? hi : x;
+    x = (lo > x)? lo : x;
+    const float z = 2 * (float)M_PI * x, z2 = z * z;
+    return z * (1 + z2 * (-1 / 6.f + z2 * (1 / 120.f + z2 * (-1 / 5040.f
+            + z2 * (1 / 362880.f - z2 / 39916800.f)))));
+}
+
+// a note sounding during one column, and its oscillator
+struct voice {
+    int key; // piano key number
+    int wave; // waveform kind
+    float amp; // amplitude
+    float pan; // stereo position, -1 (left) to 1 (right)
+    double phase; // phase in cycles at the start of the column, in [0, 1)
+    double inc; // phase increment per sample
+    float env; // envelope level at the start of the column
+    int stage; // ENV_*
+};
+
+// envelope stages
+enum {
+    ENV_ATTACK,
+    ENV_DECAY,
+    ENV_SUSTAIN,
+    ENV_RELEASE, // the note has ended
+    ENV_DONE, // released all the way to silence
+};
+
+// envelopes below this are silent, about -60 dB
+#define ENV_FLOOR 1e-3f
+
+// an attack/decay/sustain/release envelope, per sample at the render rate
+// The attack rises linearly to 1. The decay falls exponentially to the
+// sustain level and the release to silence, each getting within ENV_FLOOR
+// in its time.
+struct envelope {
+    float attack; // level added per sample, 0 for an instant attack
+    float decay; // factor of the distance to the sustain level kept per sample
+    float sustain; // level held until the note ends
+    float release; // factor of the level kept per sample, 0 to stop at once
+};
+
+// attack, decay and release times in seconds, rate = samples per second
+void envelope_init(struct envelope *e, float attack, float decay, float sustain,
+        float release, unsigned int rate)
+{
+    e->attack = (attack > 0)? 1 / (attack * rate) : 0;
+    e->decay = (decay > 0)? expf(logf(ENV_FLOOR) / (decay * rate)) : 0;
+    e->sustain = sustain;
+    e->release = (release > 0)? expf(logf(ENV_FLOOR) / (release * rate)) : 0;
+}
+
+// advance the envelope of v by n samples
+// A stage ending inside the n samples only starts the next one at the end,
+// which is close enough when n is a mixing block.
+// returns the level after them
+static float envelope_advance(const struct envelope *e, struct voice *v, unsigned int n)
+{
+    float x = v->env;
+    switch (v->stage)
+    {
+        case ENV_ATTACK:
+            x = e->attack? x + n * e->attack : 1;
+            if (x >= 1)
+            {
+                x = 1;
+                v->stage = ENV_DECAY;
+            }
+            break;
+        case ENV_DECAY:
+            x = e->sustain + (x - e->sustain) * powf(e->decay, n);
+            if (fabsf(x - e->sustain) < ENV_FLOOR)
+            {
+                x = e->sustain;
+                v->stage = ENV_SUSTAIN;
+            }
+            break;
+        case ENV_RELEASE:
+            x *= powf(e->release, n);
+            if (x < ENV_FLOOR)
+            {
+                x = 0;
+                v->stage = ENV_DONE;
+            }
+            break;
+    }
+    v->env = x;
+    return x;
+}
+
+// which notes keep a voice when a column has more notes than voices
+enum {
+    PRIORITY_AMP, // loudest first
+    PRIORITY_LOW, // lowest pitch first
+    PRIORITY_HIGH, // highest pitch first
+};
+
+// most voices at once: a note on every key, and as many more releasing
+#define MAX_VOICES (2 * NUM_KEYS)
+
+// voices that persist from column to column, so a held note keeps its
+// oscillator instead of being restarted
+struct voice_pool {
+    unsigned int count;
+    struct voice voices[MAX_VOICES];
+    unsigned long stolen; // notes dropped for lack of a voice
+};
+
+// the oscillators of one waveform, as arrays for the mixing kernels
+// p = phase in cycles at the start of the block, reduced to [0, 1)
+// dp = phase increment per sample
+// a = amplitude at the start of the block, of the left channel in stereo
+// da = change of a per sample, following the envelope
+// ar, dar = the same for the right channel, in stereo
+// A waveform has at most one voice per key, held or releasing.
+struct voice_batch {
+    unsigned int count;
+    float p[NUM_KEYS];
+    float dp[NUM_KEYS];
+    float a[NUM_KEYS];
+    float da[NUM_KEYS];
+    float ar[NUM_KEYS];
+    float dar[NUM_KEYS];
+};
+
+// samples per mixing block; small enough for a block to stay in L1 while
+// every voice of a batch is added into it
+#define MIX_BLOCK 256
+
+// PolyBLEP residual of a unit-height step at phase 0, times two
+// t = phase in [0, 1), dt = phase increment per sample (below 0.5), idt = 1/dt
+static inline float blep(float t, float dt, float idt)
+{
+    // written as selects, which vectorize when built with -fno-trapping-math
+    const float a = 1 - t * idt, b = 1 + (t - 1) * idt;
+    const float ra = -a * a, rb = b * b;
+    const float r = (t < dt)? ra : 0;
+    return (t > 1 - dt)? rb : r;
+}
+
+// PolyBLAMP residual of a unit change in slope per sample at phase 0
+static inline float blamp(float t, float dt, float idt)
+{
+    const float a = 1 - t * idt, b = 1 + (t - 1) * idt;
+    const float ra = a * a * a * (1 / 6.f), rb = b * b * b * (1 / 6.f);
+    const float r = (t < dt)? ra : 0;
+    return (t > 1 - dt)? rb : r;
+}
+
+// waveforms as functions of non-negative phase in cycles, matching the naive
+// generators
+// x = phase, dt = phase increment per sample, idt = 1/dt
+static inline float osc_sine(float x, float dt, float idt) { return sin_cycles(x); }
+static inline float osc_saw(float x, float dt, float idt) { return frac_pos(x) - 0.5f; }
+static inline float osc_triangle(float x, float dt, float idt) { return 2 * fabsf(frac_pos(x) - 0.5f) - 0.5f; }
+static inline float osc_square(float x, float dt, float idt) { return (frac_pos(x) < 0.5f)? 1 : -1; }
+
+// band-limited versions, which smooth each discontinuity (or corner, for the
+// triangle) over the two nearest samples instead of aliasing
+static inline float osc_saw_bl(float x, float dt, float idt)
+{
+    const float t = frac_pos(x);
+    return t - 0.5f - 0.5f * blep(t, dt, idt);
+}
+
+static inline float osc_triangle_bl(float x, float dt, float idt)
+{
+    const float t = frac_pos(x), h = frac_pos(t + 0.5f);
+    // the slope changes by -4 cycles^-1 at the peak and +4 at the trough
+    return 2 * fabsf(t - 0.5f) - 0.5f + 4 * dt * (blamp(h, dt, idt) - blamp(t, dt, idt));
+}
+
+static inline float osc_square_bl(float x, float dt, float idt)
+{
+    const float t = frac_pos(x), h = frac_pos(t + 0.5f);
+    return ((t < 0.5f)? 1 : -1) + blep(t, dt, idt) - blep(h, dt, idt);
+}
+
+// add s samples of every voice in the batch to o
+// fn is always a constant, so each caller gets its own vectorizable loop
+static inline __attribute__((always_inline)) void mix_batch_with(
+        float *o, unsigned int s, const struct voice_batch *b,
+        float (*fn)(float, float, float))
+{
+    for (unsigned int v = 0; v < b->count; v++)
+    {
+        const float p = b->p[v], dp = b->dp[v], a = b->a[v], da = b->da[v];
+        const float idp = 1 / dp;
+        // held notes skip the ramp
+        if (da == 0)
+            for (unsigned int i = 0; i < s; i++)
+                o[i] += a * fn(p + i * dp, dp, idp);
+        else
+            for (unsigned int i = 0; i < s; i++)
+                o[i] += (a + i * da) * fn(p + i * dp, dp, idp);
+    }
+}
+
+// add s samples of every voice in the batch to l and r, at their own
+// amplitudes; the oscillator is only evaluated once for both
+static inline __attribute__((always_inline)) void mix_batch_stereo_with(
+        float *l, float *r, unsigned int s, const struct voice_batch *b,
+        float (*fn)(float, float, float))
+{
+    for (unsigned int v = 0; v < b->count; v++)
+    {
+        const float p = b->p[v], dp = b->dp[v];
+        const float al = b->a[v], dal = b->da[v], ar = b->ar[v], dar = b->dar[v];
+        const float idp = 1 / dp;
+        if (dal == 0 && dar == 0)
+            for (unsigned int i = 0; i < s; i++)
+            {
+                const float y = fn(p + i * dp, dp, idp);
+                l[i] += al * y;
+                r[i] += ar * y;
+            }
+        else
+            for (unsigned int i = 0; i < s; i++)
+            {
+                const float y = fn(p + i * dp, dp, idp);
+                l[i] += (al + i * dal) * y;
+                r[i] += (ar + i * dar) * y;
+            }
+    }
+}
+
+// mixing kernel for one waveform
+typedef void (*mix_fn)(float *o, unsigned int s, const struct voice_batch *b);
+typedef void (*mix_stereo_fn)(float *l, float *r, unsigned int s, const struct voice_batch *b);
+
+KERNEL void mix_sine(float *o, unsigned int s, const struct voice_batch *b) { mix_batch_with(o, s, b, osc_sine); }
+KERNEL void mix_saw(float *o, unsigned int s, const struct voice_batch *b) { mix_batch_with(o, s, b, osc_saw); }
+KERNEL void mix_triangle(float *o, unsigned int s, const struct voice_batch *b) { mix_batch_with(o, s, b, osc_triangle); }
+KERNEL void mix_square(float *o, unsigned int s, const struct voice_batch *b) { mix_batch_with(o, s, b, osc_square); }
+KERNEL void mix_saw_bl(float *o, unsigned int s, const struct voice_batch *b) { mix_batch_with(o, s, b, osc_saw_bl); }
+KERNEL void mix_triangle_bl(float *o, unsigned int s, const struct voice_batch *b) { mix_batch_with(o, s, b, osc_triangle_bl); }
+KERNEL void mix_square_bl(float *o, unsigned int s, const struct voice_batch *b) { mix_batch_with(o, s, b, osc_square_bl); }
+KERNEL void mix_sine_stereo(float *l, float *r, unsigned int s, const struct voice_batch *b) { mix_batch_stereo_with(l, r, s, b, osc_sine); }
+KERNEL void mix_saw_stereo(float *l, float *r, unsigned int s, const struct voice_batch *b) { mix_batch_stereo_with(l, r, s, b, osc_saw); }
+KERNEL void mix_triangle_stereo(float *l, float *r, unsigned int s, const struct voice_batch *b) { mix_batch_stereo_with(l, r, s, b, osc_triangle); }
+KERNEL void mix_square_stereo(float *l, float *r, unsigned int s, const struct voice_batch *b) { mix_batch_stereo_with(l, r, s, b, osc_square); }
+KERNEL void mix_saw_bl_stereo(float *l, float *r, unsigned int s, const struct voice_batch *b) { mix_batch_stereo_with(l, r, s, b, osc_saw_bl); }
+KERNEL void mix_triangle_bl_stereo(float *l, float *r, unsigned int s, const struct voice_batch *b) { mix_batch_stereo_with(l, r, s, b, osc_triangle_bl); }
+KERNEL void mix_square_bl_stereo(float *l, float *r, unsigned int s, const struct voice_batch *b) { mix_batch_stereo_with(l, r, s, b, osc_square_bl); }
+
+// kernels indexed by waveform kind
+static const mix_fn naive_kernels[] = {
+    [WAVE_SINE] = mix_sine,
+    [WAVE_SAW] = mix_saw,
+    [WAVE_TRIANGLE] = mix_triangle,
+    [WAVE_SQUARE] = mix_square,
+};
+static const mix_fn bandlimited_kernels[] = {
+    [WAVE_SINE] = mix_sine,
+    [WAVE_SAW] = mix_saw_bl,
+    [WAVE_TRIANGLE] = mix_triangle_bl,
+    [WAVE_SQUARE] = mix_square_bl,
+};
+static const mix_stereo_fn naive_stereo_kernels[] = {
+    [WAVE_SINE] = mix_sine_stereo,
+    [WAVE_SAW] = mix_saw_stereo,
+    [WAVE_TRIANGLE] = mix_triangle_stereo,
+    [WAVE_SQUARE] = mix_square_stereo,
+};
+static const mix_stereo_fn bandlimited_stereo_kernels[] = {
+    [WAVE_SINE] = mix_sine_stereo,
+    [WAVE_SAW] = mix_saw_bl_stereo,
+    [WAVE_TRIANGLE] = mix_triangle_bl_stereo,
+    [WAVE_SQUARE] = mix_square_bl_stereo,
+};
+
+// cycles per second of a waveform at frequency f, matching generate_samples()
+double wave_cycles(int wave, float f)
+{
+    // sine() is sin(2*f*t), which completes f/pi cycles per second
+    return (wave == WAVE_SINE)? f / M_PI : f;
+}
+
+// left and right gains of a stereo position, at constant power
+static inline void pan_gains(float pan, float *l, float *r)
+{
+    const float t = (pan + 1) * (float)(M_PI / 4);
+    *l = cosf(t);
+    *r = sinf(t);
+}
+
+// mix voices into o, or into o and o2 in stereo, which must be zeroed, and
+// advance their phases
+// Voices are grouped by waveform and each group is added in one pass per
+// block, so the output block is only loaded and stored once per group no
+// matter how many voices it has.
+// s = number of samples
+// mix, mix2 = kernels to use, indexed by waveform kind
+// env = envelope to advance the voices along, or NULL to hold them at full
+// level; the kernels ramp linearly between its levels at block edges
+static inline __attribute__((always_inline)) void mix_voices_n(
+        float *o, float *o2, struct voice *voices, unsigned int count, unsigned int s,
+        const mix_fn *mix, const mix_stereo_fn *mix2, const int stereo,
+        const struct envelope *env)
+{
+    static const int waves[] = {WAVE_SINE, WAVE_SAW, WAVE_TRIANGLE, WAVE_SQUARE};
+    unsigned int idx[NUM_KEYS] = {0}; // batch entry -> voice
+    float amp[NUM_KEYS], amp_r[NUM_KEYS]; // amplitudes before the envelope
+    for (unsigned int k = 0; k < sizeof(waves) / sizeof(*waves); k++)
+    {
+        struct voice_batch b;
+        b.count = 0;
+        for (unsigned int v = 0; v < count; v++)
+        {
+            if (voices[v].wave != waves[k])
+                continue;
+            assert(b.count < NUM_KEYS && "two voices of one waveform on a key");
+            idx[b.count] = v;
+            b.dp[b.count] = voices[v].inc;
+            amp[b.count] = voices[v].amp;
+            if (stereo)
+            {
+                float gl, gr;
+                pan_gains(voices[v].pan, &gl, &gr);
+                amp[b.count] = voices[v].amp * gl;
+                amp_r[b.count] = b.ar[b.count] = voices[v].amp * gr;
+                b.dar[b.count] = 0;
+            }
+            b.a[b.count] = amp[b.count];
+            b.da[b.count] = 0;
+            b.count++;
+        }
+        if (!b.count)
+            continue;
+        for (unsigned int i = 0; i < s; i += MIX_BLOCK)
+        {
+            unsigned int len = (s - i < MIX_BLOCK)? s - i : MIX_BLOCK;
+            // rebase the phases at every block so that float precision
+            // does not degrade over long columns
+            for (unsigned int v = 0; v < b.count; v++)
+            {
+                struct voice *vc = &voices[idx[v]];
+                double p = vc->phase + i * vc->inc;
+                b.p[v] = p - floor(p);
+                if (!env)
+                    continue;
+                const float e0 = vc->env, e1 = envelope_advance(env, vc, len);
+                b.a[v] = amp[v] * e0;
+                b.da[v] = amp[v] * (e1 - e0) / len;
+                if (stereo)
+                {
+                    b.ar[v] = amp_r[v] * e0;
+                    b.dar[v] = amp_r[v] * (e1 - e0) / len;
+                }
+            }
+            if (stereo)
+                mix2[waves[k]](o + i, o2 + i, len, &b);
+            else
+                mix[waves[k]](o + i, len, &b);
+        }
+    }
+    for (unsigned int v = 0; v < count; v++)
+    {
+        double p = voices[v].phase + s * voices[v].inc;
+        voices[v].phase = p - floor(p);
+    }
+}
+
+void mix_voices(
+        float *o, struct voice *voices, unsigned int count, unsigned int s,
+        const mix_fn *mix, const struct envelope *env)
+{
+    mix_voices_n(o, NULL, voices, count, s, mix, NULL, 0, env);
+}
+
+// mix_voices() into a left and a right channel, placed by their pan
+void mix_voices_stereo(
+        float *l, float *r, struct voice *voices, unsigned int count, unsigned int s,
+        const mix_stereo_fn *mix, const struct envelope *env)
+{
+    mix_voices_n(l, r, voices, count, s, NULL, mix, 1, env);
+}
+
+// Fixed-point synthesis, for hosts with a slow FPU
+// Phases are 32-bit accumulators (2^32 per cycle), waveforms and amplitudes
+// are Q15 (32768 = 1.0) and voices are mixed into 32-bit integers, so
+// nothing per sample touches floating point.
+//
+// Error bound against the float path, checked by --bench: every voice stays
+// within FIXED_MAX_ERROR 16-bit steps of full scale. The one exception is a
+// sample that lands within rounding distance of a saw or square edge, which
+// either path may put on either side of the jump; fewer than
+// FIXED_MAX_EDGE_MISS of the samples may do so.
+#define FIXED_MAX_ERROR 2
+#define FIXED_MAX_EDGE_MISS 1e-3
+#define SINE_TABLE_BITS 12
+#define SINE_TABLE_SIZE (1 << SINE_TABLE_BITS)
+
+// one cycle of sine in Q15, with a guard entry for interpolation
+static int32_t sine_table[SINE_TABLE_SIZE + 1];
+
+void sine_table_init(void)
+{
+    for (int i = 0; i <= SINE_TABLE_SIZE; i++)
+        sine_table[i] = lrint(32768 * sin(2 * M_PI * i / SINE_TABLE_SIZE));
+}
+
+// fixed-point waveforms of a 32-bit phase, in Q15
+static inline int32_t osc_sine_q(uint32_t p)
+{
+    const uint32_t i = p >> (32 - SINE_TABLE_BITS);
+    const int32_t f = (p >> (16 - SINE_TABLE_BITS)) & 0xffff; // next 16 bits
+    const int32_t a = sine_table[i], b = sine_table[i + 1];
+    return a + (((b - a) * f + (1 << 15)) >> 16);
+}
+static inline int32_t osc_saw_q(uint32_t p) { return (int32_t)(p >> 17) - 16384; }
+static inline int32_t osc_triangle_q(uint32_t p) { return abs((int32_t)(p >> 16) - 32768) - 16384; }
+static inline int32_t osc_square_q(uint32_t p) { return (p < 0x80000000u)? 32768 : -32768; }
+
+// fixed-point oscillators of one waveform
+// p = phase at the start of the block, dp = increment, a = amplitude in Q15
+// (of the left channel in stereo), ar = right amplitude in stereo
+struct voice_batch_fixed {
+    unsigned int count;
+    uint32_t p[NUM_KEYS];
+    uint32_t dp[NUM_KEYS];
+    int32_t a[NUM_KEYS];
+    int32_t ar[NUM_KEYS];
+};
+
+static inline __attribute__((always_inline)) void mix_fixed_with(
+        int32_t *o, unsigned int s, const struct voice_batch_fixed *b,
+        int32_t (*fn)(uint32_t))
+{
+    for (unsigned int v = 0; v < b->count; v++)
+    {
+        const uint32_t p = b->p[v], dp = b->dp[v];
+        const int32_t a = b->a[v];
+        for (unsigned int i = 0; i < s; i++)
+            o[i] += (a * fn(p + i * dp) + (1 << 14)) >> 15;
+    }
+}
+
+static inline __attribute__((always_inline)) void mix_fixed_stereo_with(
+        int32_t *l, int32_t *r, unsigned int s, const struct voice_batch_fixed *b,
+        int32_t (*fn)(uint32_t))
+{
+    for (unsigned int v = 0; v < b->count; v++)
+    {
+        const uint32_t p = b->p[v], dp = b->dp[v];
+        const int32_t al = b->a[v], ar = b->ar[v];
+        for (unsigned int i = 0; i < s; i++)
+        {
+            const int32_t y = fn(p + i * dp);
+            l[i] += (al * y + (1 << 14)) >> 15;
+            r[i] += (ar * y + (1 << 14)) >> 15;
+        }
+    }
+}
+
+KERNEL void mix_fixed_stereo(int32_t *l, int32_t *r, unsigned int s, int wave,
+        const struct voice_batch_fixed *b)
+{
+    switch (wave)
+    {
+        case WAVE_SINE:
+            mix_fixed_stereo_with(l, r, s, b, osc_sine_q);
+            break;
+        case WAVE_SAW:
+            mix_fixed_stereo_with(l, r, s, b, osc_saw_q);
+            break;
+        case WAVE_TRIANGLE:
+            mix_fixed_stereo_with(l, r, s, b, osc_triangle_q);
+            break;
+        case WAVE_SQUARE:
+            mix_fixed_stereo_with(l, r, s, b, osc_square_q);
+            break;
+        default:
+            assert(0 && "invalid wave kind");
+            break;
+    }
+}
+
+KERNEL void mix_fixed(int32_t *o, unsigned int s, int wave, const struct voice_batch_fixed *b)
+{
+    switch (wave)
+    {
+        case WAVE_SINE:
+            mix_fixed_with(o, s, b, osc_sine_q);
+            break;
+        case WAVE_SAW:
+            mix_fixed_with(o, s, b, osc_saw_q);
+            break;
+        case WAVE_TRIANGLE:
+            mix_fixed_with(o, s, b, osc_triangle_q);
+            break;
+        case WAVE_SQUARE:
+            mix_fixed_with(o, s, b, osc_square_q);
+            break;
+        default:
+            assert(0 && "invalid wave kind");
+            break;
+    }
+}
+
+// 32-bit phase accumulator value of a phase in cycles, in [0, 1)
+static inline uint32_t phase_q32(double p)
+{
+    return (uint32_t)(uint64_t)(p * 4294967296.0 + 0.5);
+}
+
+// Q15 amplitude of a float one, at most full scale
+static inline int32_t amp_q15(float a)
+{
+    int32_t q = lrintf(a * 32768);
+    return (q > 32768)? 32768 : q;
+}
+
+// fixed-point version of mix_voices(), into Q15 samples, or into o and o2
+// in stereo
+// The 32-bit accumulators wrap on their own, so unlike the float path the
+// phases need no rebasing within a column.
+static void mix_voices_fixed_n(int32_t *o, int32_t *o2, struct voice *voices,
+        unsigned int count, unsigned int s)
+{
+    static const int waves[] = {WAVE_SINE, WAVE_SAW, WAVE_TRIANGLE, WAVE_SQUARE};
+    for (unsigned int k = 0; k < sizeof(waves) / sizeof(*waves); k++)
+    {
+        struct voice_batch_fixed b;
+        b.count = 0;
+        for (unsigned int v = 0; v < count; v++)
+        {
+            const struct voice *vc = &voices[v];
+            if (vc->wave != waves[k])
+                continue;
+            b.p[b.count] = phase_q32(vc->phase);
+            b.dp[b.count] = (uint32_t)llround(vc->inc * 4294967296.0);
+            b.a[b.count] = amp_q15(vc->amp);
+            if (o2)
+            {
+                float gl, gr;
+                pan_gains(vc->pan, &gl, &gr);
+                b.a[b.count] = amp_q15(vc->amp * gl);
+                b.ar[b.count] = amp_q15(vc->amp * gr);
+            }
+            b.count++;
+        }
+        if (b.count && o2)
+            mix_fixed_stereo(o, o2, s, waves[k], &b);
+        else if (b.count)
+            mix_fixed(o, s, waves[k], &b);
+    }
+    for (unsigned int v = 0; v < count; v++)
+    {
+        double p = voices[v].phase + s * voices[v].inc;
+        voices[v].phase = p - floor(p);
+    }
+}
+
+void mix_voices_fixed(int32_t *o, struct voice *voices, unsigned int count, unsigned int s)
+{
+    mix_voices_fixed_n(o, NULL, voices, count, s);
+}
+
+void mix_voices_fixed_stereo(int32_t *l, int32_t *r, struct voice *voices,
+        unsigned int count, unsigned int s)
+{
+    mix_voices_fixed_n(l, r, voices, count, s);
+}
+
+// non-zero if note a should get a voice before note b
+static inline int note_beats(const struct voice *a, const struct voice *b, int priority)
+{
+    switch (priority)
+    {
+        case PRIORITY_HIGH:
+            return a->key > b->key;
+        case PRIORITY_LOW:
+            return a->key < b->key;
+        default:
+            // equally loud notes go to the lower key
+            if (a->amp != b->amp)
+                return a->amp > b->amp;
+            return a->key < b->key;
+    }
+}
+
+// restore the min-heap property below node i of a heap of n notes
+static void heap_sift(struct voice *h, unsigned int n, unsigned int i, int priority)
+{
+    for (;;)
+    {
+        unsigned int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && note_beats(&h[m], &h[l], priority))
+            m = l;
+        if (r < n && note_beats(&h[m], &h[r], priority))
+            m = r;
+        if (m == i)
+            return;
+        struct voice t = h[i];
+        h[i] = h[m];
+        h[m] = t;
+        i = m;
+    }
+}
+
+// keep the max best of count notes at the front of notes, in any order
+// Uses a min-heap of the kept notes, so a column costs O(count log max) no
+// matter how crowded it is.
+// returns the number of notes kept
+unsigned int select_notes(struct voice *notes, unsigned int count, unsigned int max, int priority)
+{
+    if (count <= max)
+        return count;
+    // notes[0..max) is a heap with the weakest kept note on top
+    for (unsigned int i = max / 2; i-- > 0; )
+        heap_sift(notes, max, i, priority);
+    for (unsigned int i = max; i < count; i++)
+    {
+        if (!note_beats(&notes[i], &notes[0], priority))
+            continue;
+        notes[0] = notes[i];
+        heap_sift(notes, max, 0, priority);
+    }
+    return max;
+}
+
+// assign voices to the notes of a new column
+// Notes that were already playing on the same key and waveform keep their
+// oscillator; new notes start in phase with absolute time like
+// generate_samples() does.
+// s0 = absolute sample index of the column start
+// r = sample rate
+// notes = the new notes, with room for MAX_VOICES voices
+// env = envelope of the voices, or NULL to start and stop them at once
+void pool_update(
+        struct voice_pool *pool, struct voice *notes, unsigned int count,
+        unsigned int max, int priority, uint64_t s0, unsigned int r,
+        const struct envelope *env)
+{
+    unsigned int kept = select_notes(notes, count, max, priority);
+    pool->stolen += count - kept;
+    // previous voice of each key and waveform, or -1
+    int prev[NUM_KEYS + 1][WAVE_SQUARE + 1];
+    // whether each previous voice goes on as one of the notes
+    unsigned char taken[MAX_VOICES] = {0};
+    memset(prev, -1, sizeof(prev));
+    for (unsigned int v = 0; v < pool->count; v++)
+        if (pool->voices[v].stage != ENV_DONE)
+            prev[pool->voices[v].key][pool->voices[v].wave] = v;
+    for (unsigned int i = 0; i < kept; i++)
+    {
+        struct voice *n = &notes[i];
+        int j = prev[n->key][n->wave];
+        if (j >= 0)
+        {
+            const struct voice *pv = &pool->voices[j];
+            n->phase = pv->phase;
+            n->inc = pv->inc;
+            // a released note struck again rises from where it was
+            n->env = pv->env;
+            n->stage = (pv->stage == ENV_RELEASE)? ENV_ATTACK : pv->stage;
+            taken[j] = 1;
+        }
+        else
+        {
+            n->inc = wave_cycles(n->wave, key_to_frequency(n->key)) / r;
+            double p = s0 * n->inc;
+            n->phase = p - floor(p);
+            n->env = env? 0 : 1;
+            n->stage = env? ENV_ATTACK : ENV_SUSTAIN;
+        }
+    }
+    // ended notes keep their voice, after the notes, while they release
+    unsigned int total = kept;
+    if (env && env->release)
+    {
+        for (unsigned int v = 0; v < pool->count && total < MAX_VOICES; v++)
+        {
+            if (taken[v] || pool->voices[v].stage == ENV_DONE)
+                continue;
+            notes[total] = pool->voices[v];
+            notes[total++].stage = ENV_RELEASE;
+        }
+    }
+    memcpy(pool->voices, notes, total * sizeof(*notes));
+    pool->count = total;
+}
+
+// seconds on a monotonic clock
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// energy of the aliased partials relative to the real ones, in dB, for one
+// voice of a kernel at a pitch where partials above Nyquist fold back onto
+// frequencies that are not harmonics
+double bench_alias(mix_fn mix)
+{
+    const unsigned int n = 4096, cycles = 205; // 2402 Hz at 48 kHz
+    float *re = calloc(n, sizeof(float)), *im = calloc(n, sizeof(float));
+    struct voice_batch b = {.count = 1};
+    b.dp[0] = (float)cycles / n;
+    b.a[0] = 1;
+    for (unsigned int i = 0; i < n; i += MIX_BLOCK)
+    {
+        double p = (double)i * cycles / n;
+        b.p[0] = p - floor(p);
+        mix(re + i, MIX_BLOCK, &b);
+    }
+    fft(re, im, n, 0);
+    double harmonic = 0, alias = 0;
+    for (unsigned int k = 1; k < n / 2; k++)
+    {
+        double e = re[k] * re[k] + im[k] * im[k];
+        if (k % cycles == 0)
+            harmonic += e;
+        else
+            alias += e;
+    }
+    free(re);
+    free(im);
+    return 10 * log10(alias / harmonic);
+}
+
+// time the fixed-point kernels and check them against the float path
+void bench_fixed(FILE *fp, unsigned int rate)
+{
+    static const char *names[] = {
+        [WAVE_SINE] = "sine",
+        [WAVE_SAW] = "saw",
+        [WAVE_TRIANGLE] = "triangle",
+        [WAVE_SQUARE] = "square",
+    };
+    const unsigned int s = 1 << 19, check = 1 << 14;
+    int32_t *q = malloc(check * sizeof(*q));
+    float *o = malloc(check * sizeof(*o));
+    fprintf(fp, "\n%-10s %-14s %16s %12s %12s\n", "waveform", "oscillator",
+            "ns/voice-sample", "max error", "edge misses");
+    for (int w = 0; w < sizeof(names) / sizeof(*names); w++)
+    {
+        struct voice_batch_fixed b = {.count = NUM_KEYS};
+        for (unsigned int v = 0; v < NUM_KEYS; v++)
+        {
+            b.p[v] = 0;
+            b.dp[v] = llround(wave_cycles(w, key_to_frequency(v + 1)) / rate * 4294967296.0);
+            b.a[v] = 32768 / NUM_KEYS;
+        }
+        double t0 = now();
+        for (unsigned int i = 0; i < s; i += MIX_BLOCK)
+            mix_fixed(q, MIX_BLOCK, w, &b);
+        double t = now() - t0;
+
+        // one voice at a time at full scale, in 16-bit steps
+        double max_err = 0;
+        unsigned long misses = 0;
+        for (unsigned int k = 1; k <= NUM_KEYS; k++)
+        {
+            struct voice fv = {.key = k, .wave = w, .amp = 1, .phase = 0.1};
+            fv.inc = wave_cycles(w, key_to_frequency(k)) / rate;
+            struct voice qv = fv;
+            memset(o, 0, check * sizeof(*o));
+            memset(q, 0, check * sizeof(*q));
+            mix_voices(o, &fv, 1, check, naive_kernels, NULL);
+            mix_voices_fixed(q, &qv, 1, check);
+            for (unsigned int i = 0; i < check; i++)
+            {
+                double e = fabs(o[i] * 32768 - q[i]);
+                if (e > FIXED_MAX_ERROR)
+                    misses++;
+                else if (e > max_err)
+                    max_err = e;
+            }
+        }
+        double miss_rate = (double)misses / ((double)check * NUM_KEYS);
+        int ok = (w == WAVE_SAW || w == WAVE_SQUARE)?
+            miss_rate < FIXED_MAX_EDGE_MISS : !misses;
+        fprintf(fp, "%-10s %-14s %16.3f %12.2f %11.4f%% %s\n", names[w], "fixed-point",
+                t * 1e9 / ((double)s * NUM_KEYS), max_err, miss_rate * 100,
+                ok? "ok" : "OUT OF BOUND");
+    }
+    free(q);
+    free(o);
+}
+
+// time the stereo kernels against the mono ones, with every key sounding
+void bench_stereo(FILE *fp, unsigned int rate)
+{
+    static const char *names[] = {
+        [WAVE_SINE] = "sine",
+        [WAVE_SAW] = "saw",
+        [WAVE_TRIANGLE] = "triangle",
+        [WAVE_SQUARE] = "square",
+    };
+    const unsigned int s = 1 << 19;
+    float *l = calloc(MIX_BLOCK, sizeof(float)), *r = calloc(MIX_BLOCK, sizeof(float));
+    fprintf(fp, "\n%-10s %-14s %16s %12s\n", "waveform", "oscillator", "ns/voice-sample", "x mono");
+    for (int w = 0; w < sizeof(names) / sizeof(*names); w++)
+    {
+        struct voice_batch b = {.count = NUM_KEYS};
+        for (unsigned int v = 0; v < NUM_KEYS; v++)
+        {
+            b.p[v] = 0;
+            b.dp[v] = wave_cycles(w, key_to_frequency(v + 1)) / rate;
+            pan_gains(v * (2.0f / (NUM_KEYS - 1)) - 1, &b.a[v], &b.ar[v]);
+            b.a[v] /= NUM_KEYS;
+            b.ar[v] /= NUM_KEYS;
+        }
+        double t0 = now();
+        for (unsigned int i = 0; i < s; i += MIX_BLOCK)
+            naive_kernels[w](l, MIX_BLOCK, &b);
+        double mono = now() - t0;
+        t0 = now();
+        for (unsigned int i = 0; i < s; i += MIX_BLOCK)
+            naive_stereo_kernels[w](l, r, MIX_BLOCK, &b);
+        double t = now() - t0;
+        fprintf(fp, "%-10s %-14s %16.3f %12.2f\n", names[w], "naive stereo",
+                t * 1e9 / ((double)s * NUM_KEYS), t / mono);
+    }
+    free(l);
+    free(r);
+}
+
+// time the mixing kernels with every key sounding, and compare the naive
+// oscillators with the band-limited ones
+void bench(FILE *fp, unsigned int rate)
+{
+    static const char *names[] = {
+        [WAVE_SINE] = "sine",
+        [WAVE_SAW] = "saw",
+        [WAVE_TRIANGLE] = "triangle",
+        [WAVE_SQUARE] = "square",
+    };
+    static const struct {
+        const char *name;
+        const mix_fn *kernels;
+    } sets[] = {
+        {"naive", naive_kernels},
+        {"band-limited", bandlimited_kernels},
+    };
+    const unsigned int s = 1 << 19;
+    float *o = calloc(MIX_BLOCK, sizeof(float));
+    fprintf(fp, "kernels: %s\n\n", dispatch_level());
+    fprintf(fp, "%-10s %-14s %16s %12s\n", "waveform", "oscillator", "ns/voice-sample", "alias (dB)");
+    for (int w = 0; w < sizeof(names) / sizeof(*names); w++)
+    {
+        for (int k = 0; k < sizeof(sets) / sizeof(*sets); k++)
+        {
+            mix_fn mix = sets[k].kernels[w];
+            struct voice_batch b = {.count = NUM_KEYS};
+            for (unsigned int v = 0; v < NUM_KEYS; v++)
+            {
+                b.p[v] = 0;
+                b.dp[v] = wave_cycles(w, key_to_frequency(v + 1)) / rate;
+                b.a[v] = 1.0 / NUM_KEYS;
+            }
+            double t0 = now();
+            for (unsigned int i = 0; i < s; i += MIX_BLOCK)
+                mix(o, MIX_BLOCK, &b);
+            double t = now() - t0;
+            fprintf(fp, "%-10s %-14s %16.3f %12.1f\n", names[w], sets[k].name,
+                    t * 1e9 / ((double)s * NUM_KEYS), bench_alias(mix));
+        }
+    }
+    free(o);
+    bench_stereo(fp, rate);
+    bench_fixed(fp, rate);
+}
+
+int process_check(
+        char *in_filename, char *out_filename, const struct config *c)
+{
+    if (!in_filename) 
+    {
+        fprintf(stderr, "invalid input filename\n");
+        return 1;
+    }
+    // --verify writes no output
+    if (!out_filename && !c->verify)
+    {
+        fprintf(stderr, "invalid output filename\n");
+        return 1;
+    }
+    if (out_filename && strcmp(in_filename, out_filename) == 0 && strcmp(in_filename, "-") != 0)
+    {
+        fprintf(stderr, "input filename and output filename must be different\n");
+        return 1;
+    }
+    if (!c->rate)
+    {
+        fprintf(stderr, "invalid rate\n");
+        return 1;
+    }
+    if (!c->spp)
+    {
+        fprintf(stderr, "invalid samples per pixel\n");
+        return 1;
+    }
+    if (!c->oversample || (c->oversample > 1 && c->mode == MODE_SPECTROGRAM))
+    {
+        fprintf(stderr, "oversampling is only supported for notes\n");
+        return 1;
+    }
+    if (c->fixed && (c->mode != MODE_NOTES || c->oversample > 1 || c->bandlimit))
+    {
+        fprintf(stderr, "the fixed-point path only renders notes with naive waves at the output rate\n");
+        return 1;
+    }
+    if (c->frames != FRAMES_FIRST && c->mode != MODE_NOTES)
+    {
+        fprintf(stderr, "only notes can be rendered from several frames\n");
+        return 1;
+    }
+    if (strcmp(in_filename, "-") == 0
+            && (c->mode != MODE_NOTES || c->to_score || c->frames != FRAMES_FIRST))
+    {
+        fprintf(stderr, "a stream on stdin can only be rendered as notes to audio\n");
+        return 1;
+    }
+    if (c->limit && c->fixed)
+    {
+        fprintf(stderr, "the fixed-point path cannot be limited\n");
+        return 1;
+    }
+    if (c->normalize && (c->mode != MODE_NOTES || strcmp(in_filename, "-") == 0))
+    {
+        fprintf(stderr, "only notes from an image or a score can be normalized\n");
+        return 1;
+    }
+    if (c->envelope && (c->mode != MODE_NOTES || c->fixed))
+    {
+        fprintf(stderr, "only notes rendered in floating point can have an envelope\n");
+        return 1;
+    }
+    if (c->pan && c->mode != MODE_NOTES)
+    {
+        fprintf(stderr, "only notes can be panned\n");
+        return 1;
+    }
+    if (c->to_score && c->mode != MODE_NOTES)
+    {
+        fprintf(stderr, "only notes can be written as a score\n");
+        return 1;
+    }
+    if (c->preview && c->mode != MODE_NOTES)
+    {
+        fprintf(stderr, "only notes can be previewed\n");
+        return 1;
+    }
+    if (c->verify && (c->mode != MODE_NOTES || strcmp(in_filename, "-") == 0))
+    {
+        fprintf(stderr, "only notes from an image or a score can be verified\n");
+        return 1;
+    }
+    if (c->mode == MODE_SPECTROGRAM)
+    {
+        if (c->fft_size < 16 || (c->fft_size & (c->fft_size - 1)))
+        {
+            fprintf(stderr, "FFT size must be a power of 2 of at least 16\n");
+            return 1;
+        }
+        if (!c->hop || c->hop > c->fft_size)
+        {
+            fprintf(stderr, "hop size must be between 1 and the FFT size\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// taps per polyphase branch of the decimation filter
+#define DECIMATOR_TAPS 49
+
+// polyphase FIR decimator, for rendering at a multiple of the output rate
+// The filter is split into m branches that each run at the output rate on
+// every m-th input sample, so only the kept outputs are ever computed and
+// each input sample costs DECIMATOR_TAPS multiply-adds.
+struct decimator {
+    unsigned int m; // decimation factor
+    unsigned int max_out; // most outputs per call
+    float *h; // m * DECIMATOR_TAPS taps, h[q * m + p] is tap q of branch p
+    float *in; // m - 1 previous inputs followed by the current block
+    float *u; // m branch inputs, DECIMATOR_TAPS - 1 + max_out values each
+};
+
+// m = decimation factor
+// max_in = most input samples per call, a multiple of m
+int decimator_init(struct decimator *d, unsigned int m, unsigned int max_in)
+{
+    const unsigned int len = m * DECIMATOR_TAPS;
+    const unsigned int stride = DECIMATOR_TAPS - 1 + max_in / m;
+    d->m = m;
+    d->max_out = max_in / m;
+    d->h = malloc(len * sizeof(float));
+    d->in = calloc(m - 1 + max_in, sizeof(float));
+    d->u = calloc((size_t)m * stride, sizeof(float));
+    if (!d->h || !d->in || !d->u)
+        return 1;
+    // Blackman-windowed sinc centered on an output sample, so the delay is a
+    // whole number of output samples; the last m - 1 taps are 0
+    const unsigned int span = (DECIMATOR_TAPS - 1) * m; // window length - 1
+    const double fc = 0.45 / m; // cutoff, in cycles per input sample
+    double sum = 0;
+    for (unsigned int k = 0; k < len; k++)
+    {
+        double x = (double)k - span / 2;
+        double hk = 0;
+        if (k <= span)
+        {
+            double win = 0.42 - 0.5 * cos(2 * M_PI * k / span) + 0.08 * cos(4 * M_PI * k / span);
+            double sinc = (x == 0)? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x);
+            hk = win * sinc;
+        }
+        d->h[k] = hk;
+        sum += hk;
+    }
+    for (unsigned int k = 0; k < len; k++)
+        d->h[k] /= sum;
+    return 0;
+}
+
+void decimator_free(struct decimator *d)
+{
+    free(d->h);
+    free(d->in);
+    free(d->u);
+}
+
+// delay of the decimator in output samples, which is the same for every factor
+unsigned int decimator_delay(void)
+{
+    return (DECIMATOR_TAPS - 1) / 2;
+}
+
+// decimate n input samples (a multiple of m) into n/m outputs
+KERNEL void decimate(struct decimator *d, const float *x, unsigned int n, float *y)
+{
+    const unsigned int m = d->m, out = n / m;
+    const unsigned int stride = DECIMATOR_TAPS - 1 + d->max_out;
+    assert(n % m == 0 && out <= d->max_out);
+    memcpy(d->in + m - 1, x, n * sizeof(float));
+    // branch p sees x[j*m - p] for output j
+    for (unsigned int p = 0; p < m; p++)
+    {
+        float *u = d->u + (size_t)p * stride + DECIMATOR_TAPS - 1;
+        const float *src = d->in + m - 1 - p;
+        for (unsigned int j = 0; j < out; j++)
+            u[j] = src[j * m];
+    }
+    memset(y, 0, out * sizeof(float));
+    for (unsigned int p = 0; p < m; p++)
+    {
+        const float *u = d->u + (size_t)p * stride + DECIMATOR_TAPS - 1;
+        for (unsigned int q = 0; q < DECIMATOR_TAPS; q++)
+        {
+            const float hq = d->h[q * m + p];
+            const float *uq = u - q;
+            for (unsigned int j = 0; j < out; j++)
+                y[j] += hq * uq[j];
+        }
+    }
+    // keep the history for the next call
+    for (unsigned int p = 0; p < m; p++)
+    {
+        float *u = d->u + (size_t)p * stride;
+        memmove(u, u + out, (DECIMATOR_TAPS - 1) * sizeof(float));
+    }
+    memmove(d->in, d->in + n, (m - 1) * sizeof(float));
+}
+
+// highest level the limiter lets through, -0.5 dBFS
+#define LIMITER_CEILING 0.944f
+// look-ahead of the limiter, and the time it takes to let go, in seconds
+#define LIMITER_LOOKAHEAD 0.005
+#define LIMITER_RELEASE 0.1
+
+// a gain of 1 in the moving average, which sums integers
+#define LIMITER_ONE (1u << 24)
+// a gain this close to 1 is let go of entirely once nothing needs limiting
+#define LIMITER_IDLE 0.9999f
+
+// streaming peak limiter with a short look-ahead
+// Each sample needs a gain of at most LIMITER_CEILING over its peak. The
+// lowest such gain over a window of d + 1 samples, smoothed by a moving
+// average over the same window, is applied to the sample at the start of the
+// window, so the gain is already down when a peak arrives and no sample goes
+// over the ceiling. The gain then recovers exponentially. Memory does not
+// grow with the length of the input.
+struct limiter {
+    unsigned int d; // look-ahead in samples; the output is this much late
+    unsigned int channels;
+    float release; // fraction of the gain reduction recovered per sample
+    float *delay; // the last d inputs of each channel, oldest first
+    float *need; // queue of the gains needed in the window, increasing
+    uint64_t *when; // sample index of each queue entry
+    unsigned int head, count; // of the queue, a ring of d + 1 entries
+    uint32_t *smooth; // the last d + 1 gains before averaging, in LIMITER_ONE units
+    int64_t sum; // of smooth, exact so it never drifts
+    unsigned int pos; // index into smooth of the next gain
+    float gain; // current gain before averaging
+    float lowest; // lowest gain applied so far
+    uint64_t n; // samples in
+};
+
+int limiter_init(struct limiter *l, unsigned int channels, unsigned int rate)
+{
+    const unsigned int d = LIMITER_LOOKAHEAD * rate + 1;
+    memset(l, 0, sizeof(*l));
+    l->channels = channels;
+    l->release = 1 - exp(-1 / (LIMITER_RELEASE * rate));
+    l->delay = calloc((size_t)d * channels, sizeof(float));
+    l->need = malloc((d + 1) * sizeof(float));
+    l->when = malloc((d + 1) * sizeof(uint64_t));
+    l->smooth = malloc((d + 1) * sizeof(uint32_t));
+    if (!l->delay || !l->need || !l->when || !l->smooth)
+        return 1;
+    for (unsigned int k = 0; k <= d; k++)
+        l->smooth[k] = LIMITER_ONE;
+    l->sum = (int64_t)LIMITER_ONE * (d + 1);
+    l->gain = l->lowest = 1;
+    // the queue starts with a need of 1, as if silence came before
+    l->need[0] = 1;
+    l->when[0] = 0;
+    l->count = 1;
+    l->d = d; // set last, so a limiter is only used once it is complete
+    return 0;
+}
+
+void limiter_free(struct limiter *l)
+{
+    free(l->delay);
+    free(l->need);
+    free(l->when);
+    free(l->smooth);
+}
+
+// delay x by d samples through the line of the last d inputs, times gain g
+// y = output, which may be g
+KERNEL static void limiter_apply(float *delay, unsigned int d, const float *x, unsigned int s,
+        const float *g, float *y)
+{
+    const unsigned int head = (s < d)? s : d;
+    for (unsigned int i = 0; i < head; i++)
+        y[i] = g[i] * delay[i];
+    for (unsigned int i = d; i < s; i++)
+        y[i] = g[i] * x[i - d];
+    if (s >= d)
+        memcpy(delay, x + s - d, d * sizeof(float));
+    else
+    {
+        memmove(delay, delay + s, (d - s) * sizeof(float));
+        memcpy(delay + d - s, x, s * sizeof(float));
+    }
+}
+
+// turn the gains needed by s samples in y into the gains to apply to the
+// samples d back
+static void limiter_gains(struct limiter *l, float *y, unsigned int s)
+{
+    const unsigned int w = l->d + 1;
+    // the gain to apply to the sample d back, also in y
+    // (the state is kept in locals, which y could otherwise alias)
+    float *need = l->need;
+    uint32_t *smooth = l->smooth;
+    uint64_t *when = l->when, n = l->n;
+    int64_t sum = l->sum;
+    unsigned int head = l->head, count = l->count, pos = l->pos;
+    float gain = l->gain, lowest = l->lowest;
+    const float release = l->release, iw = 1.0f / ((float)LIMITER_ONE * w);
+    for (unsigned int i = 0; i < s; i++)
+    {
+        const float ni = y[i];
+        // the front of the queue is the lowest need in the window
+        while (count)
+        {
+            unsigned int back = head + count - 1;
+            back -= (back >= w)? w : 0;
+            if (need[back] < ni)
+                break;
+            count--;
+        }
+        unsigned int t = head + count;
+        t -= (t >= w)? w : 0;
+        need[t] = ni;
+        when[t] = n;
+        count++;
+        if (when[head] + w <= n)
+        {
+            head = (head + 1 == w)? 0 : head + 1;
+            count--;
+        }
+        // drop at once, recover slowly
+        float g = gain + (1 - gain) * release;
+        gain = g = (need[head] < g)? need[head] : g;
+        // rounded down, so the average never exceeds the needs
+        const uint32_t q = g * LIMITER_ONE;
+        sum += (int64_t)q - smooth[pos];
+        smooth[pos] = q;
+        const float a = sum * iw;
+        lowest = (a < lowest)? a : lowest;
+        y[i] = a;
+        n++;
+        pos = (pos + 1 == w)? 0 : pos + 1;
+    }
+    l->n = n;
+    l->head = head;
+    l->count = count;
+    l->pos = pos;
+    l->gain = gain;
+    l->lowest = lowest;
+    l->sum = sum;
+}
+
+// limit s samples of x into y, d samples late
+// x2, y2 = the right channel in stereo, or NULL; both channels get the same
+// gain so the stereo image stays put
+void limit(struct limiter *l, const float *x, const float *x2, unsigned int s,
+        float *y, float *y2)
+{
+    const unsigned int d = l->d, w = d + 1;
+    // the gain each sample needs, in y for now
+    for (unsigned int i = 0; i < s; i++)
+        y[i] = fabsf(x[i]);
+    if (x2)
+        for (unsigned int i = 0; i < s; i++)
+            y[i] = fmaxf(y[i], fabsf(x2[i]));
+    unsigned int over = 0; // samples over the ceiling
+    for (unsigned int i = 0; i < s; i++)
+    {
+        over += y[i] > LIMITER_CEILING;
+        y[i] = (y[i] > LIMITER_CEILING)? LIMITER_CEILING / y[i] : 1;
+    }
+    if (!over && l->need[l->head] == 1 && l->gain >= LIMITER_IDLE)
+    {
+        // nothing to limit ahead or behind: the gain is 1 throughout, and the
+        // window holds nothing but needs of 1
+        if (l->sum != (int64_t)LIMITER_ONE * w)
+        {
+            for (unsigned int k = 0; k < w; k++)
+                l->smooth[k] = LIMITER_ONE;
+            l->sum = (int64_t)LIMITER_ONE * w;
+        }
+        l->gain = 1;
+        l->n += s;
+        l->pos = (l->pos + s) % w;
+        l->head = 0;
+        l->count = 1;
+        l->need[0] = 1;
+        l->when[0] = l->n - 1;
+    }
+    else
+        limiter_gains(l, y, s);
+    if (x2)
+        limiter_apply(l->delay + d, d, x2, s, y, y2);
+    limiter_apply(l->delay, d, x, s, y, y);
+}
+
+// skip s silent samples, once a whole window of silence has gone in
+// Only the gain needs to move on; the window is treated as holding the
+// new gain throughout, which only changes how it recovers.
+void limiter_skip(struct limiter *l, uint64_t s)
+{
+    if (!s)
+        return;
+    const unsigned int w = l->d + 1;
+    l->gain = 1 - (1 - l->gain) * pow(1 - l->release, (double)s);
+    const uint32_t q = l->gain * LIMITER_ONE;
+    for (unsigned int k = 0; k < w; k++)
+        l->smooth[k] = q;
+    l->sum = (int64_t)q * w;
+    l->n += s;
+    // the silence needs no reduction
+    l->head = 0;
+    l->count = 1;
+    l->need[0] = 1;
+    l->when[0] = l->n - 1;
+}
+
+// bytes per sample of each output format
+static const unsigned int format_size[] = {
+    [FORMAT_S8] = 1,
+    [FORMAT_S16] = 2,
+    [FORMAT_U8] = 1,
+};
+
+// a minimal io_uring, set up with the raw system calls
+struct uring {
+    int fd;
+    void *sq_ring, *cq_ring; // mapped rings
+    size_t sq_len, cq_len;
+    struct io_uring_sqe *sqes; // mapped submission entries
+    size_t sqes_len;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+// returns non-zero if io_uring is not available
+int uring_init(struct uring *u, unsigned int entries)
+{
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params p = {0};
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return 1;
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->sq_len = u->cq_len = (u->sq_len > u->cq_len)? u->sq_len : u->cq_len;
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP)? u->sq_ring :
+        mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED)
+    {
+        if (u->sq_ring == MAP_FAILED)
+            u->sq_ring = NULL;
+        if (u->cq_ring == MAP_FAILED)
+            u->cq_ring = NULL;
+        if (u->sqes == MAP_FAILED)
+            u->sqes = NULL;
+        return 1;
+    }
+    char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// queue a write and submit it
+// returns non-zero if there is an error
+int uring_write(struct uring *u, int fd, const void *buf, unsigned int len,
+        uint64_t offset, uint64_t user_data)
+{
+    unsigned int tail = *u->sq_tail, i = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    u->sq_array[i] = i;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    int n;
+    while ((n = syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0)) < 0 && errno == EINTR)
+        ;
+    return n != 1;
+}
+
+// take the next completion, waiting for one if wait is set
+// returns non-zero if there is none
+int uring_complete(struct uring *u, int wait, uint64_t *user_data, int *res)
+{
+    unsigned int head = *u->cq_head;
+    while (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        if (!wait)
+            return 1;
+        if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                && errno != EINTR)
+            return 1;
+    }
+    const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void uring_free(struct uring *u)
+{
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_len);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_len);
+    if (u->fd > 0)
+        close(u->fd);
+    memset(u, 0, sizeof(*u));
+}
+
+// blocks in the queue between the renderer and the writer thread
+#define WRITER_BLOCKS 4
+#define DEFAULT_BLOCK_SIZE (1 << 20)
+// alignment of blocks, offsets and lengths for direct I/O
+#define DIRECT_ALIGN 4096
+
+// a block of output bytes and where they go in the file
+struct out_block {
+    unsigned char *data;
+    size_t len; // bytes used
+    uint64_t offset; // file offset of the first byte
+};
+
+// writes full blocks on its own thread, or submits them to io_uring, so
+// the renderer only waits for storage when every block is queued
+struct writer {
+    int fd;
+    char seekable; // blocks are written at their offsets with pwrite()
+    char direct; // the file is open with O_DIRECT
+    size_t block_size;
+    struct out_block blocks[WRITER_BLOCKS]; // a ring, filled in order
+    unsigned int queued; // blocks waiting for the writer thread
+    uint64_t filled, written; // blocks handed over and written so far
+    pthread_t thread;
+    char running; // the thread is up; otherwise blocks are written inline
+    char done; // no more blocks will come
+    int error; // errno of the first failed write
+    uint64_t stalls; // times the renderer waited for a free block
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char uring; // blocks go to ring instead of the thread
+    char uring_missing; // io_uring was asked for but is not available
+    struct uring ring;
+    char busy[WRITER_BLOCKS]; // the block has a write in flight on ring
+};
+
+// write a block, all of it from byte done on
+static int block_write(struct writer *w, const struct out_block *b, size_t done)
+{
+    while (done < b->len)
+    {
+        ssize_t n = w->seekable?
+            pwrite(w->fd, b->data + done, b->len - done, b->offset + done) :
+            write(w->fd, b->data + done, b->len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL && w->direct)
+        {
+            // the file system took O_DIRECT at open but not for writes
+            w->direct = 0;
+            if (fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT) == 0)
+                continue;
+        }
+        if (n <= 0)
+            return (n < 0)? errno : EIO;
+        done += n;
+    }
+    return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct writer *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;)
+    {
+        while (!w->queued && !w->done)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->queued)
+            break;
+        struct out_block *b = &w->blocks[w->written % WRITER_BLOCKS];
+        pthread_mutex_unlock(&w->lock);
+        int err = block_write(w, b, 0);
+        pthread_mutex_lock(&w->lock);
+        if (err && !w->error)
+            w->error = err;
+        w->written++;
+        w->queued--;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// wait for io_uring writes until block i is free
+static void writer_reap(struct writer *w, unsigned int i)
+{
+    while (w->busy[i])
+    {
+        uint64_t id;
+        int res, err = 0;
+        if (uring_complete(&w->ring, 1, &id, &res))
+        {
+            // the ring is broken, so write what is in flight again
+            for (unsigned int j = 0; j < WRITER_BLOCKS; j++)
+            {
+                if (!w->busy[j])
+                    continue;
+                err = block_write(w, &w->blocks[j], 0);
+                if (err && !w->error)
+                    w->error = err;
+                w->busy[j] = 0;
+                w->queued--;
+                w->written++;
+            }
+            w->uring = 0;
+            return;
+        }
+        struct out_block *b = &w->blocks[id];
+        // short or failed writes (such as O_DIRECT being refused) are
+        // finished the plain way
+        if (res < 0 || (size_t)res < b->len)
+            err = block_write(w, b, (res < 0)? 0 : res);
+        if (err && !w->error)
+            w->error = err;
+        w->busy[id] = 0;
+        w->queued--;
+        w->written++;
+    }
+}
+
+// block_size must be a multiple of DIRECT_ALIGN
+// uring = submit the writes to io_uring, if it is available
+// returns non-zero if there is an error
+int writer_init(
+        struct writer *w, int fd, char seekable, char direct, size_t block_size,
+        char uring)
+{
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->seekable = seekable;
+    w->direct = direct;
+    w->block_size = block_size;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    for (unsigned int i = 0; i < WRITER_BLOCKS; i++)
+    {
+        // aligned so the blocks can go straight to an O_DIRECT file
+        void *p;
+        if (posix_memalign(&p, DIRECT_ALIGN, block_size))
+            return 1;
+        w->blocks[i].data = p;
+    }
+    // blocks can complete out of order, which only files put up with
+    if (uring && seekable && !uring_init(&w->ring, WRITER_BLOCKS))
+    {
+        w->uring = 1;
+        return 0;
+    }
+    w->uring_missing = uring;
+    uring_free(&w->ring);
+    w->running = pthread_create(&w->thread, NULL, writer_thread, w) == 0;
+    return 0;
+}
+
+// the block being filled
+static inline struct out_block *writer_block(struct writer *w)
+{
+    return &w->blocks[w->filled % WRITER_BLOCKS];
+}
+
+// hand the block being filled to the writer thread and start the next one
+// at offset
+void writer_submit(struct writer *w, uint64_t offset)
+{
+    struct out_block *b = writer_block(w);
+    if (b->len)
+    {
+        if (w->uring)
+        {
+            const unsigned int i = w->filled % WRITER_BLOCKS;
+            w->busy[i] = 1;
+            w->queued++;
+            if (uring_write(&w->ring, w->fd, b->data, b->len, b->offset, i))
+            {
+                // could not submit, so write it now
+                int err = block_write(w, b, 0);
+                if (err && !w->error)
+                    w->error = err;
+                w->busy[i] = 0;
+                w->queued--;
+                w->written++;
+            }
+            w->filled++;
+            const unsigned int next = w->filled % WRITER_BLOCKS;
+            if (w->busy[next])
+            {
+                w->stalls++;
+                writer_reap(w, next);
+            }
+        }
+        else if (!w->running)
+        {
+            int err = block_write(w, b, 0);
+            if (err && !w->error)
+                w->error = err;
+            w->filled++;
+        }
+        else
+        {
+            pthread_mutex_lock(&w->lock);
+            w->filled++;
+            w->queued++;
+            pthread_cond_broadcast(&w->cond);
+            if (w->queued == WRITER_BLOCKS)
+                w->stalls++;
+            while (w->queued == WRITER_BLOCKS)
+                pthread_cond_wait(&w->cond, &w->lock);
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    b = writer_block(w);
+    b->len = 0;
+    b->offset = offset;
+}
+
+// write out the last block and stop the thread
+// returns the errno of the first failed write, or 0
+int writer_finish(struct writer *w, uint64_t offset)
+{
+    if (!w->block_size)
+        return 0;
+    writer_submit(w, offset);
+    for (unsigned int i = 0; w->uring && i < WRITER_BLOCKS; i++)
+        writer_reap(w, i);
+    if (w->running)
+    {
+        pthread_mutex_lock(&w->lock);
+        w->done = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        w->running = 0;
+    }
+    return w->error;
+}
+
+void writer_free(struct writer *w)
+{
+    if (!w->block_size)
+        return;
+    for (unsigned int i = 0; i < WRITER_BLOCKS; i++)
+        free(w->blocks[i].data);
+    uring_free(&w->ring);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+}
+
+// FLAC frames hold this many samples of each channel
+#define FLAC_BLOCK 4096
+
+// frames a worker encodes in one go
+#define FLAC_CHUNK_FRAMES 32
+
+// most threads encoding FLAC
+#define FLAC_MAX_THREADS 16
+
+// the fLaC marker and the STREAMINFO block at the start of the file
+#define FLAC_HEADER_SIZE 42
+
+// FLAC checksums: CRC-8 of frame headers, CRC-16 of whole frames
+static uint8_t flac_crc8_table[256];
+static uint16_t flac_crc16_table[256];
+
+static void flac_tables_init(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint8_t c8 = i;
+        uint16_t c16 = i << 8;
+        for (int j = 0; j < 8; j++)
+        {
+            c8 = (c8 << 1) ^ ((c8 & 0x80)? 0x07 : 0);
+            c16 = (c16 << 1) ^ ((c16 & 0x8000)? 0x8005 : 0);
+        }
+        flac_crc8_table[i] = c8;
+        flac_crc16_table[i] = c16;
+    }
+}
+
+// writes a big-endian bit stream, as FLAC frames are
+struct bits {
+    unsigned char *p; // next byte
+    uint64_t acc; // bits not stored yet, in the low bits
+    unsigned int n; // number of bits in acc
+};
+
+// put the low n bits of x, n <= 32
+static inline void bits_put(struct bits *b, uint32_t x, unsigned int n)
+{
+    b->acc = (b->acc << n) | (x & (uint32_t)((1ull << n) - 1));
+    b->n += n;
+    while (b->n >= 8)
+    {
+        b->n -= 8;
+        *b->p++ = b->acc >> b->n;
+    }
+}
+
+// put n zero bits, then a one
+static inline void bits_unary(struct bits *b, uint32_t n)
+{
+    for (; n >= 32; n -= 32)
+        bits_put(b, 0, 32);
+    bits_put(b, 1, n + 1);
+}
+
+// pad with zeros to a whole byte
+static inline void bits_align(struct bits *b)
+{
+    if (b->n)
+        bits_put(b, 0, 8 - b->n);
+}
+
+// a run of frames for one worker
+struct flac_chunk {
+    int32_t *samples; // interleaved samples
+    unsigned int count; // samples in samples[], of all channels
+    uint64_t frame; // number of the first frame
+    char last; // the end of the stream, so the last frame may be short
+    char encoded; // data is ready to be written
+    unsigned char *data; // encoded frames
+    size_t len;
+    unsigned int min_frame, max_frame; // smallest and largest frame in bytes
+};
+
+// compresses the output as FLAC: workers encode chunks of frames while the
+// renderer fills the next one, and the chunks are written in order
+struct flac_encoder {
+    unsigned int channels, bits; // bits per sample, 8 or 16
+    unsigned int slots; // chunks in the ring
+    struct flac_chunk *chunks;
+    uint64_t filling; // chunk the renderer fills; chunks before it are queued
+    uint64_t next; // next queued chunk for a worker
+    uint64_t collected; // chunks written to the output so far
+    uint64_t samples; // samples of each channel so far
+    unsigned int min_frame, max_frame; // smallest and largest frame in bytes
+    pthread_t threads[FLAC_MAX_THREADS];
+    unsigned int running; // threads started; none means encoding inline
+    char done; // no more chunks will come
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// fixed predictor residual of order k at i
+static inline int32_t flac_residual(const int32_t *x, int i, int k)
+{
+    switch (k)
+    {
+        case 0: return x[i];
+        case 1: return x[i] - x[i - 1];
+        case 2: return x[i] - 2 * x[i - 1] + x[i - 2];
+        case 3: return x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+        default: return x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+    }
+}
+
+// Rice parameter for m values summing to sum, and its cost in bits
+static inline unsigned int flac_rice_param(uint64_t m, uint64_t sum, uint64_t *cost)
+{
+    unsigned int k = 0;
+    while (k < 14 && (m << (k + 1)) < sum)
+        k++;
+    *cost = 4 + m * (k + 1) + (sum >> k);
+    return k;
+}
+
+// put one channel of a frame as a subframe
+// x = n samples, b = bits per sample
+static void flac_subframe(struct bits *out, const int32_t *x, unsigned int n, unsigned int b)
+{
+    const uint32_t mask = (uint32_t)((1ull << b) - 1);
+    unsigned int i;
+    for (i = 1; i < n && x[i] == x[0]; i++)
+        ;
+    if (i == n)
+    {
+        bits_put(out, 0x00, 8); // CONSTANT
+        bits_put(out, x[0] & mask, b);
+        return;
+    }
+
+    // pick the fixed predictor with the smallest residual
+    int order = -1;
+    if (n > 4)
+    {
+        uint64_t sum[5] = {0};
+        for (i = 4; i < n; i++)
+            for (int k = 0; k < 5; k++)
+                sum[k] += abs(flac_residual(x, i, k));
+        order = 0;
+        for (int k = 1; k < 5; k++)
+            if (sum[k] < sum[order])
+                order = k;
+    }
+    if (order >= 0)
+    {
+        // residuals folded to unsigned
+        uint32_t u[FLAC_BLOCK];
+        for (i = order; i < n; i++)
+        {
+            int32_t r = flac_residual(x, i, order);
+            u[i] = ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+        }
+
+        // the finest partitions that fit, then each coarser order in turn,
+        // keeping the cheapest
+        unsigned int max_p = 0;
+        while (max_p < 8 && !(n & (1u << max_p)) && (n >> (max_p + 1)) > (unsigned int)order)
+            max_p++;
+        uint64_t psum[1 << 8];
+        const unsigned int fine = n >> max_p;
+        for (unsigned int j = 0; j < (1u << max_p); j++)
+        {
+            psum[j] = 0;
+            for (i = (j == 0)? order : j * fine; i < (j + 1) * fine; i++)
+                psum[j] += u[i];
+        }
+        unsigned int best_p = 0;
+        uint64_t best = UINT64_MAX;
+        for (int p = max_p; p >= 0; p--)
+        {
+            const unsigned int parts = 1u << p;
+            uint64_t cost = 0;
+            for (unsigned int j = 0; j < parts; j++)
+            {
+                uint64_t c;
+                flac_rice_param((n >> p) - (j? 0 : order), psum[j], &c);
+                cost += c;
+            }
+            if (cost <= best)
+            {
+                best = cost;
+                best_p = p;
+            }
+            // merge pairs for the next order
+            for (unsigned int j = 0; j < parts / 2; j++)
+                psum[j] = psum[2 * j] + psum[2 * j + 1];
+        }
+
+        // the estimate leaves out the bits below each Rice parameter, so
+        // count exactly before choosing this over the samples verbatim
+        const unsigned int parts = 1u << best_p, len = n >> best_p;
+        unsigned int param[1 << 8];
+        uint64_t exact = 8 + (uint64_t)order * b + 6;
+        for (unsigned int j = 0; j < parts; j++)
+        {
+            const unsigned int begin = j? j * len : order, end = (j + 1) * len;
+            uint64_t s = 0, c;
+            for (i = begin; i < end; i++)
+                s += u[i];
+            unsigned int k = param[j] = flac_rice_param(end - begin, s, &c);
+            exact += 4 + (uint64_t)(end - begin) * (k + 1);
+            for (i = begin; i < end; i++)
+                exact += u[i] >> k;
+        }
+        if (exact < 8 + (uint64_t)n * b)
+        {
+            bits_put(out, (8 + order) << 1, 8); // FIXED
+            for (i = 0; i < (unsigned int)order; i++)
+                bits_put(out, x[i] & mask, b);
+            bits_put(out, 0, 2); // Rice coding with 4-bit parameters
+            bits_put(out, best_p, 4);
+            for (unsigned int j = 0; j < parts; j++)
+            {
+                const unsigned int k = param[j], end = (j + 1) * len;
+                bits_put(out, k, 4);
+                for (i = j? j * len : order; i < end; i++)
+                {
+                    const uint32_t q = u[i] >> k;
+                    if (q + 1 + k <= 32)
+                        bits_put(out, (1u << k) | (u[i] & ((1u << k) - 1)), q + 1 + k);
+                    else
+                    {
+                        bits_unary(out, q);
+                        bits_put(out, u[i], k);
+                    }
+                }
+            }
+            return;
+        }
+    }
+    bits_put(out, 0x02, 8); // VERBATIM
+    for (i = 0; i < n; i++)
+        bits_put(out, x[i] & mask, b);
+}
+
+// encode one frame of n samples per channel at p
+// returns the frame length in bytes
+static size_t flac_frame(const struct flac_encoder *f, unsigned char *p,
+        const int32_t *x, unsigned int n, uint64_t number)
+{
+    struct bits out = {p};
+    bits_put(&out, 0xfff8, 16); // sync code, fixed block size
+    // block size 4096, or in 16 bits after the frame number; the sample rate
+    // is in STREAMINFO
+    bits_put(&out, (n == FLAC_BLOCK)? 0xc0 : 0x70, 8);
+    bits_put(&out, ((f->channels - 1) << 4) | (((f->bits == 16)? 4 : 1) << 1), 8);
+    // the frame number, coded like UTF-8
+    if (number < 0x80)
+        bits_put(&out, number, 8);
+    else
+    {
+        int extra = 1;
+        while (number >> (6 * extra + 6 - extra))
+            extra++;
+        bits_put(&out, (0xff00 >> (extra + 1)) | (number >> (6 * extra)), 8);
+        for (int i = extra - 1; i >= 0; i--)
+            bits_put(&out, 0x80 | ((number >> (6 * i)) & 0x3f), 8);
+    }
+    if (n != FLAC_BLOCK)
+        bits_put(&out, n - 1, 16);
+    uint8_t crc8 = 0;
+    for (unsigned char *q = p; q < out.p; q++)
+        crc8 = flac_crc8_table[crc8 ^ *q];
+    bits_put(&out, crc8, 8);
+
+    // channels are coded independently
+    int32_t channel[FLAC_BLOCK];
+    for (unsigned int c = 0; c < f->channels; c++)
+    {
+        for (unsigned int i = 0; i < n; i++)
+            channel[i] = x[i * f->channels + c];
+        flac_subframe(&out, channel, n, f->bits);
+    }
+    bits_align(&out);
+    uint16_t crc16 = 0;
+    for (unsigned char *q = p; q < out.p; q++)
+        crc16 = (crc16 << 8) ^ flac_crc16_table[(crc16 >> 8) ^ *q];
+    bits_put(&out, crc16, 16);
+    return out.p - p;
+}
+
+// encode the whole frames of a chunk, and a short one if it is the last
+static void flac_encode_chunk(const struct flac_encoder *f, struct flac_chunk *ch)
+{
+    const unsigned int per_channel = ch->count / f->channels;
+    unsigned int frames = per_channel / FLAC_BLOCK;
+    if (ch->last && per_channel % FLAC_BLOCK)
+        frames++;
+    ch->len = 0;
+    ch->min_frame = UINT_MAX;
+    ch->max_frame = 0;
+    for (unsigned int i = 0; i < frames; i++)
+    {
+        const unsigned int start = i * FLAC_BLOCK;
+        const unsigned int n = (per_channel - start < FLAC_BLOCK)? per_channel - start : FLAC_BLOCK;
+        size_t len = flac_frame(f, ch->data + ch->len,
+                ch->samples + (size_t)start * f->channels, n, ch->frame + i);
+        ch->len += len;
+        ch->min_frame = (len < ch->min_frame)? len : ch->min_frame;
+        ch->max_frame = (len > ch->max_frame)? len : ch->max_frame;
+    }
+}
+
+static void *flac_thread(void *arg)
+{
+    struct flac_encoder *f = arg;
+    pthread_mutex_lock(&f->lock);
+    for (;;)
+    {
+        while (f->next == f->filling && !f->done)
+            pthread_cond_wait(&f->cond, &f->lock);
+        if (f->next == f->filling)
+            break;
+        struct flac_chunk *ch = &f->chunks[f->next++ % f->slots];
+        pthread_mutex_unlock(&f->lock);
+        flac_encode_chunk(f, ch);
+        pthread_mutex_lock(&f->lock);
+        ch->encoded = 1;
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return NULL;
+}
+
+// channels = interleaved channels, bits = 8 or 16
+// threads = workers to start
+// returns non-zero if out of memory
+int flac_init(struct flac_encoder *f, unsigned int channels, unsigned int bits,
+        unsigned int threads)
+{
+    memset(f, 0, sizeof(*f));
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    flac_tables_init();
+    f->channels = channels;
+    f->bits = bits;
+    if (threads > FLAC_MAX_THREADS)
+        threads = FLAC_MAX_THREADS;
+    // enough chunks to keep every worker busy while the renderer fills one,
+    // and one more to keep the next chunk's part frame
+    f->slots = 2 * threads + 2;
+    f->min_frame = UINT_MAX;
+    f->chunks = calloc(f->slots, sizeof(*f->chunks));
+    if (!f->chunks)
+        return 1;
+    const size_t count = (size_t)FLAC_CHUNK_FRAMES * FLAC_BLOCK * channels;
+    // no frame is longer than its samples verbatim, a subframe header per
+    // channel, and the frame header and CRC
+    const size_t frame_max = (size_t)FLAC_BLOCK * channels * bits / 8 + channels + 18;
+    for (unsigned int i = 0; i < f->slots; i++)
+    {
+        f->chunks[i].samples = malloc(count * sizeof(int32_t));
+        f->chunks[i].data = malloc(FLAC_CHUNK_FRAMES * frame_max);
+        if (!f->chunks[i].samples || !f->chunks[i].data)
+            return 1;
+    }
+    while (f->running < threads
+            && pthread_create(&f->threads[f->running], NULL, flac_thread, f) == 0)
+        f->running++;
+    return 0;
+}
+
+// the chunk the renderer fills
+static inline struct flac_chunk *flac_filling(struct flac_encoder *f)
+{
+    return &f->chunks[f->filling % f->slots];
+}
+
+// the oldest chunk not yet written, if it is encoded (or wait for it),
+// or NULL
+static struct flac_chunk *flac_collect(struct flac_encoder *f, int wait)
+{
+    if (f->collected == f->filling)
+        return NULL;
+    struct flac_chunk *ch = &f->chunks[f->collected % f->slots];
+    pthread_mutex_lock(&f->lock);
+    while (wait && !ch->encoded)
+        pthread_cond_wait(&f->cond, &f->lock);
+    const int encoded = ch->encoded;
+    pthread_mutex_unlock(&f->lock);
+    if (!encoded)
+        return NULL;
+    f->collected++;
+    f->min_frame = (ch->min_frame < f->min_frame)? ch->min_frame : f->min_frame;
+    f->max_frame = (ch->max_frame > f->max_frame)? ch->max_frame : f->max_frame;
+    return ch;
+}
+
+// queue the chunk being filled, with its whole frames, or all of it if last;
+// a part frame moves on to the next chunk
+// The next chunk's slot must have been collected.
+static void flac_queue(struct flac_encoder *f, int last)
+{
+    struct flac_chunk *ch = flac_filling(f);
+    const unsigned int frame_len = FLAC_BLOCK * f->channels;
+    const unsigned int whole = last? ch->count : ch->count / frame_len * frame_len;
+    const unsigned int rest = ch->count - whole;
+    ch->last = last;
+    ch->count = whole;
+    f->samples += whole / f->channels;
+    pthread_mutex_lock(&f->lock);
+    ch->encoded = 0;
+    f->filling++;
+    if (f->running)
+        pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    if (!f->running)
+    {
+        // no workers, so encode it here
+        f->next++;
+        flac_encode_chunk(f, ch);
+        ch->encoded = 1;
+    }
+    struct flac_chunk *next = flac_filling(f);
+    next->frame = ch->frame + (whole + frame_len - 1) / frame_len;
+    next->count = rest;
+    memcpy(next->samples, ch->samples + whole, rest * sizeof(int32_t));
+}
+
+// stop the workers once every queued chunk is encoded
+void flac_free(struct flac_encoder *f)
+{
+    pthread_mutex_lock(&f->lock);
+    f->done = 1;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    for (unsigned int t = 0; t < f->running; t++)
+        pthread_join(f->threads[t], NULL);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    for (unsigned int i = 0; f->chunks && i < f->slots; i++)
+    {
+        free(f->chunks[i].samples);
+        free(f->chunks[i].data);
+    }
+    free(f->chunks);
+}
+
+// fill in the fLaC marker and STREAMINFO
+// samples = samples of each channel, 0 if unknown
+// min_frame, max_frame = frame sizes in bytes, 0 if unknown
+static void flac_header(unsigned char *h, unsigned int rate, unsigned int channels,
+        unsigned int bits, uint64_t samples, unsigned int min_frame, unsigned int max_frame)
+{
+    memset(h, 0, FLAC_HEADER_SIZE);
+    memcpy(h, "fLaC", 4);
+    struct bits out = {h + 4};
+    bits_put(&out, 1, 1); // the last metadata block
+    bits_put(&out, 0, 7); // STREAMINFO
+    bits_put(&out, 34, 24);
+    bits_put(&out, FLAC_BLOCK, 16);
+    bits_put(&out, FLAC_BLOCK, 16);
+    bits_put(&out, min_frame, 24);
+    bits_put(&out, max_frame, 24);
+    bits_put(&out, rate, 20);
+    bits_put(&out, channels - 1, 3);
+    bits_put(&out, bits - 1, 5);
+    bits_put(&out, samples >> 32, 4);
+    bits_put(&out, samples, 32);
+    // the MD5 of the samples is left as zeros, for "not computed"
+}
+
+// bytes of silence written at a time, when it cannot be left as a hole
+#define OUTPUT_FILL (1 << 16)
+
+// a WAV header always takes this much, with room for the RF64 ds64 chunk
+#define WAV_HEADER_SIZE 80
+
+// the stage between the renderers and the output file
+struct output {
+    int fd;
+    struct writer w;
+    uint64_t pos; // file offset after the last byte written
+    char direct; // the file is open with O_DIRECT
+    int format; // FORMAT_*
+    unsigned int channels; // 1, or 2 for stereo
+    void *conv; // converted samples
+    struct decimator *dec[2]; // of each channel; NULL when rendering at the output rate
+    float *dec_buffer[2]; // decimated samples of each channel
+    struct limiter *lim; // NULL unless limiting
+    float *lim_buffer[2]; // limited samples of each channel
+    unsigned int max_block; // most samples per call, at the internal rate
+    float *zero; // a block of silence to push through the decimator and limiter
+    unsigned int skip; // output samples left to drop for the filter and limiter delay
+    unsigned long quiet; // silent samples since the decimator or limiter last saw sound
+    char seekable; // a regular file, which can be written at any offset
+    char sparse; // silence can be left as holes in a sparse file
+    unsigned char *fill; // a block of silence, when silence is not zero bytes
+    uint64_t hole; // bytes of silence not yet written
+    int container; // CONTAINER_*
+    unsigned int rate; // output sample rate, for the WAV header
+    uint64_t expected; // samples the header was written for, 0 if unknown
+    struct flac_encoder *flac; // NULL unless the container is FLAC
+    uint64_t silent; // samples written by the silence fast path
+    char v; // verbose flag
+};
+
+// store a 16-bit sample as little-endian
+static inline int16_t to_le16(int16_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return (int16_t)__builtin_bswap16((uint16_t)x);
+#else
+    return x;
+#endif
+}
+
+// one float sample in [-1, 1] in each output format, clipping instead of
+// wrapping around
+static inline int16_t float_to_s16(float y)
+{
+    y = (y > 1)? 1 : y;
+    y = (y < -1)? -1 : y;
+    return to_le16((int16_t)(y * INT16_MAX));
+}
+static inline int8_t float_to_s8(float y)
+{
+    y = (y > 1)? 1 : y;
+    y = (y < -1)? -1 : y;
+    return (int8_t)(y * INT8_MAX);
+}
+static inline uint8_t float_to_u8(float y) { return float_to_s8(y) + 128; }
+
+// one Q15 sample in each output format
+// Scales and truncates like the float versions do, so both paths agree.
+static inline int16_t fixed_to_s16(int32_t y)
+{
+    y = (y > 32768)? 32768 : y;
+    y = (y < -32768)? -32768 : y;
+    return to_le16(y * INT16_MAX / 32768);
+}
+static inline int8_t fixed_to_s8(int32_t y)
+{
+    y = (y > 32768)? 32768 : y;
+    y = (y < -32768)? -32768 : y;
+    return y * INT8_MAX / 32768;
+}
+static inline uint8_t fixed_to_u8(int32_t y) { return fixed_to_s8(y) + 128; }
+
+// convert s samples of x, or of x and x2 interleaved in stereo
+// stereo is always a constant; both samples of a pair are stored together so
+// that the stereo loop vectorizes as well as the mono one
+static inline __attribute__((always_inline)) void convert_float_n(
+        void *restrict dst, const float *restrict x, const float *restrict x2,
+        unsigned int s, int format, const int stereo)
+{
+    if (format == FORMAT_S16)
+    {
+        int16_t *d = dst;
+        for (size_t i = 0; i < s; i++)
+        {
+            if (!stereo)
+                d[i] = float_to_s16(x[i]);
+            else
+            {
+                d[2 * i] = float_to_s16(x[i]);
+                d[2 * i + 1] = float_to_s16(x2[i]);
+            }
+        }
+    }
+    else if (format == FORMAT_U8)
+    {
+        uint8_t *d = dst;
+        for (size_t i = 0; i < s; i++)
+        {
+            if (!stereo)
+                d[i] = float_to_u8(x[i]);
+            else
+            {
+                d[2 * i] = float_to_u8(x[i]);
+                d[2 * i + 1] = float_to_u8(x2[i]);
+            }
+        }
+    }
+    else
+    {
+        int8_t *d = dst;
+        for (size_t i = 0; i < s; i++)
+        {
+            if (!stereo)
+                d[i] = float_to_s8(x[i]);
+            else
+            {
+                d[2 * i] = float_to_s8(x[i]);
+                d[2 * i + 1] = float_to_s8(x2[i]);
+            }
+        }
+    }
+}
+
+// convert float samples in [-1, 1] to the output format, clipping instead of
+// wrapping around
+KERNEL void convert_float(void *dst, const float *x, unsigned int s, int format)
+{
+    convert_float_n(dst, x, NULL, s, format, 0);
+}
+
+// convert a left and a right channel into interleaved stereo
+KERNEL void convert_float_stereo(void *dst, const float *l, const float *r, unsigned int s, int format)
+{
+    convert_float_n(dst, l, r, s, format, 1);
+}
+
+static inline __attribute__((always_inline)) void convert_fixed_n(
+        void *restrict dst, const int32_t *restrict x, const int32_t *restrict x2,
+        unsigned int s, int format, const int stereo)
+{
+    if (format == FORMAT_S16)
+    {
+        int16_t *d = dst;
+        for (size_t i = 0; i < s; i++)
+        {
+            if (!stereo)
+                d[i] = fixed_to_s16(x[i]);
+            else
+            {
+                d[2 * i] = fixed_to_s16(x[i]);
+                d[2 * i + 1] = fixed_to_s16(x2[i]);
+            }
+        }
+    }
+    else if (format == FORMAT_U8)
+    {
+        uint8_t *d = dst;
+        for (size_t i = 0; i < s; i++)
+        {
+            if (!stereo)
+                d[i] = fixed_to_u8(x[i]);
+            else
+            {
+                d[2 * i] = fixed_to_u8(x[i]);
+                d[2 * i + 1] = fixed_to_u8(x2[i]);
+            }
+        }
+    }
+    else
+    {
+        int8_t *d = dst;
+        for (size_t i = 0; i < s; i++)
+        {
+            if (!stereo)
+                d[i] = fixed_to_s8(x[i]);
+            else
+            {
+                d[2 * i] = fixed_to_s8(x[i]);
+                d[2 * i + 1] = fixed_to_s8(x2[i]);
+            }
+        }
+    }
+}
+
+// convert Q15 samples to the output format
+KERNEL void convert_fixed(void *dst, const int32_t *x, unsigned int s, int format)
+{
+    convert_fixed_n(dst, x, NULL, s, format, 0);
+}
+
+KERNEL void convert_fixed_stereo(void *dst, const int32_t *l, const int32_t *r, unsigned int s, int format)
+{
+    convert_fixed_n(dst, l, r, s, format, 1);
+}
+
+// copy bytes into the writer's blocks
+static void output_append(struct output *o, const void *buf, size_t n)
+{
+    const unsigned char *p = buf;
+    while (n)
+    {
+        struct out_block *b = writer_block(&o->w);
+        size_t k = o->w.block_size - b->len;
+        k = (k < n)? k : n;
+        memcpy(b->data + b->len, p, k);
+        b->len += k;
+        o->pos += k;
+        p += k;
+        n -= k;
+        if (b->len == o->w.block_size)
+            writer_submit(&o->w, o->pos);
+    }
+}
+
+// store the low n bytes of x as little-endian
+static void put_le(unsigned char *p, uint64_t x, int n)
+{
+    for (int i = 0; i < n; i++)
+        p[i] = x >> (8 * i);
+}
+
+// fill in a WAV header
+// data = bytes of samples
+// known = the length is known; otherwise the sizes are left at their maximum,
+// which most readers take as "until the end of the file"
+// a file past 4 GiB becomes RF64, with the sizes in its ds64 chunk
+static void wav_header(unsigned char *h, int format, unsigned int channels,
+        unsigned int rate, uint64_t data, int known)
+{
+    const unsigned int bytes = format_size[format] * channels;
+    const uint64_t riff = WAV_HEADER_SIZE - 8 + data + (data & 1);
+    const int rf64 = known && riff > UINT32_MAX;
+    memset(h, 0, WAV_HEADER_SIZE);
+    memcpy(h, rf64? "RF64" : "RIFF", 4);
+    put_le(h + 4, (rf64 || !known)? UINT32_MAX : riff, 4);
+    memcpy(h + 8, "WAVE", 4);
+    // a plain WAV keeps the space of the ds64 chunk as a JUNK chunk
+    memcpy(h + 12, rf64? "ds64" : "JUNK", 4);
+    put_le(h + 16, 28, 4);
+    if (rf64)
+    {
+        put_le(h + 20, riff, 8);
+        put_le(h + 28, data, 8);
+        put_le(h + 36, data / bytes, 8);
+    }
+    memcpy(h + 48, "fmt ", 4);
+    put_le(h + 52, 16, 4);
+    put_le(h + 56, 1, 2); // PCM
+    put_le(h + 58, channels, 2);
+    put_le(h + 60, rate, 4);
+    put_le(h + 64, rate * bytes, 4);
+    put_le(h + 68, bytes, 2); // bytes per frame
+    put_le(h + 70, 8 * format_size[format], 2);
+    memcpy(h + 72, "data", 4);
+    put_le(h + 76, (rf64 || !known)? UINT32_MAX : data, 4);
+}
+
+// rewrite the header with the final length, once all samples are written
+// data = bytes of samples, for WAV
+// returns non-zero if there is an error
+static int output_fixup(struct output *o, uint64_t data)
+{
+    struct flac_encoder *f = o->flac;
+    const uint64_t samples = f? f->samples : data / (format_size[o->format] * o->channels);
+    if (!f && o->expected == samples)
+        return 0;
+    if (!o->seekable)
+    {
+        // a pipe cannot go back, the header says "until the end" instead
+        if (o->v && o->expected && o->expected != samples)
+            fprintf(stderr, "header on a pipe is for %llu samples, not %llu\n",
+                    (unsigned long long)o->expected, (unsigned long long)samples);
+        return 0;
+    }
+    // STREAMINFO also gets the frame sizes, which are only known now
+    unsigned char h[WAV_HEADER_SIZE];
+    size_t len = WAV_HEADER_SIZE;
+    if (f)
+    {
+        len = FLAC_HEADER_SIZE;
+        flac_header(h, o->rate, f->channels, f->bits, samples,
+                f->max_frame? f->min_frame : 0, f->max_frame);
+    }
+    else
+        wav_header(h, o->format, o->channels, o->rate, data, 1);
+    if (o->w.direct)
+    {
+        // the header is too small for direct I/O
+        int flags = fcntl(o->fd, F_GETFL);
+        if (flags < 0 || fcntl(o->fd, F_SETFL, flags & ~O_DIRECT))
+        {
+            perror("fcntl");
+            return 1;
+        }
+    }
+    if (pwrite(o->fd, h, len, 0) != (ssize_t)len)
+    {
+        perror("write");
+        return 1;
+    }
+    return 0;
+}
+
+// filename = file to create, or - for stdout
+// c = settings
+// max_block = most samples per call to output_samples()
+// samples = samples that will be written, for the header; 0 if unknown
+int output_open(struct output *o, char *filename, const struct config *c,
+        unsigned int max_block, uint64_t samples)
+{
+    memset(o, 0, sizeof(*o));
+    o->fd = -1;
+    o->container = c->container;
+    o->rate = c->rate;
+    o->expected = samples;
+    o->channels = c->pan? 2 : 1;
+    o->max_block = max_block;
+    // 8-bit WAV samples are unsigned, 8-bit FLAC samples are signed
+    o->format = c->format;
+    if (c->container == CONTAINER_WAV && c->format == FORMAT_S8)
+        o->format = FORMAT_U8;
+    if (c->container == CONTAINER_FLAC && c->format == FORMAT_U8)
+        o->format = FORMAT_S8;
+    if (c->container == CONTAINER_FLAC && c->rate >= (1 << 20))
+    {
+        fprintf(stderr, "FLAC sample rates go up to %d Hz\n", (1 << 20) - 1);
+        return 1;
+    }
+    o->conv = malloc((size_t)max_block * o->channels * format_size[o->format]);
+    if (!o->conv)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    o->v = c->v;
+    if (strcmp(filename, "-") == 0)
+        o->fd = STDOUT_FILENO;
+    else
+    {
+        const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        o->direct = c->direct;
+        o->fd = open(filename, flags | (o->direct? O_DIRECT : 0), 0666);
+        if (o->fd < 0 && o->direct && errno == EINVAL)
+        {
+            if (c->v)
+                fprintf(stderr, "direct I/O is not supported for %s\n", filename);
+            o->direct = 0;
+            o->fd = open(filename, flags, 0666);
+        }
+        if (o->fd < 0)
+        {
+            perror("open");
+            return 1;
+        }
+    }
+    struct stat st;
+    o->seekable = fstat(o->fd, &st) == 0 && S_ISREG(st.st_mode);
+    o->direct &= o->seekable;
+    if (writer_init(&o->w, o->fd, o->seekable, o->direct, c->block_size, c->io_uring))
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (o->container == CONTAINER_FLAC)
+    {
+        // silence goes to the encoder like any other samples
+        const unsigned int bits = 8 * format_size[o->format];
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        o->flac = malloc(sizeof(*o->flac));
+        if (!o->flac || flac_init(o->flac, o->channels, bits, (cpus > 0)? cpus : 1))
+        {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        unsigned char h[FLAC_HEADER_SIZE];
+        flac_header(h, o->rate, o->channels, bits, samples, 0, 0);
+        output_append(o, h, sizeof(h));
+        if (c->v)
+            fprintf(stderr, "encoding FLAC on %u thread%s\n",
+                    o->flac->running, (o->flac->running == 1)? "" : "s");
+    }
+    else if (o->format == FORMAT_U8)
+    {
+        // silence is 128, so it is never a hole
+        o->fill = malloc(OUTPUT_FILL);
+        if (!o->fill)
+        {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        memset(o->fill, 128, OUTPUT_FILL);
+    }
+    else
+        o->sparse = o->seekable && !o->direct;
+    if (o->container == CONTAINER_WAV)
+    {
+        unsigned char h[WAV_HEADER_SIZE];
+        wav_header(h, o->format, o->channels, o->rate,
+                samples * o->channels * format_size[o->format], samples != 0);
+        output_append(o, h, sizeof(h));
+    }
+    if (c->v && o->w.uring_missing)
+        fprintf(stderr, "io_uring is not available%s, writing from a thread\n",
+                o->seekable? "" : " for pipes");
+    if (c->oversample > 1 || c->limit)
+    {
+        o->zero = calloc(max_block, sizeof(float));
+        if (!o->zero)
+        {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+    if (c->oversample > 1)
+    {
+        for (unsigned int ch = 0; ch < o->channels; ch++)
+        {
+            o->dec[ch] = calloc(1, sizeof(*o->dec[ch]));
+            o->dec_buffer[ch] = malloc(max_block / c->oversample * sizeof(float));
+            if (!o->dec[ch] || !o->dec_buffer[ch]
+                    || decimator_init(o->dec[ch], c->oversample, max_block))
+            {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        o->skip = decimator_delay();
+        if (c->v)
+            fprintf(stderr, "oversampling %ux, decimating with %u taps\n",
+                    c->oversample, c->oversample * DECIMATOR_TAPS);
+    }
+    if (c->limit)
+    {
+        o->lim = calloc(1, sizeof(*o->lim));
+        for (unsigned int ch = 0; ch < o->channels; ch++)
+            o->lim_buffer[ch] = malloc(max_block / c->oversample * sizeof(float));
+        if (!o->lim || !o->lim_buffer[o->channels - 1] || !o->lim_buffer[0]
+                || limiter_init(o->lim, o->channels, c->rate))
+        {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        o->skip += o->lim->d;
+    }
+    return 0;
+}
+
+// hand the chunk being filled to the FLAC workers, and write the chunks that
+// are encoded, in order
+// last = the end of the stream
+// wait = wait for every chunk to be encoded and written
+static void output_flac_queue(struct output *o, int last, int wait)
+{
+    struct flac_encoder *f = o->flac;
+    struct flac_chunk *ch;
+    // the chunk after this one needs a free slot
+    while (f->filling + 2 - f->collected > f->slots && (ch = flac_collect(f, 1)))
+        output_append(o, ch->data, ch->len);
+    flac_queue(f, last);
+    while ((ch = flac_collect(f, wait)))
+        output_append(o, ch->data, ch->len);
+}
+
+// pass n bytes of samples, in the output format, to the FLAC encoder
+// buf = the samples, or NULL for silence
+static void output_flac(struct output *o, const void *buf, size_t n)
+{
+    struct flac_encoder *f = o->flac;
+    const unsigned int size = format_size[o->format];
+    const unsigned int chunk = FLAC_CHUNK_FRAMES * FLAC_BLOCK * f->channels;
+    const unsigned char *p = buf;
+    size_t s = n / size;
+    while (s)
+    {
+        struct flac_chunk *ch = flac_filling(f);
+        size_t k = chunk - ch->count;
+        k = (k < s)? k : s;
+        int32_t *d = ch->samples + ch->count;
+        if (!p)
+            memset(d, 0, k * sizeof(*d));
+        else if (size == 2)
+        {
+            for (size_t i = 0; i < k; i++)
+                d[i] = (int16_t)(p[2 * i] | (p[2 * i + 1] << 8));
+            p += 2 * k;
+        }
+        else
+        {
+            for (size_t i = 0; i < k; i++)
+                d[i] = (int8_t)p[i];
+            p += k;
+        }
+        ch->count += k;
+        s -= k;
+        if (ch->count == chunk)
+            output_flac_queue(o, 0, 0);
+    }
+}
+
+static void output_flush_hole(struct output *o)
+{
+    if (!o->hole)
+        return;
+    if (o->flac)
+    {
+        output_flac(o, NULL, o->hole);
+        o->hole = 0;
+        return;
+    }
+    if (o->sparse)
+    {
+        // the next block starts past the hole
+        o->pos += o->hole;
+        o->hole = 0;
+        writer_submit(&o->w, o->pos);
+        return;
+    }
+    static const unsigned char zeros[OUTPUT_FILL];
+    const unsigned char *fill = o->fill? o->fill : zeros;
+    while (o->hole)
+    {
+        size_t n = (o->hole < OUTPUT_FILL)? o->hole : OUTPUT_FILL;
+        output_append(o, fill, n);
+        o->hole -= n;
+    }
+}
+
+static void output_bytes(struct output *o, const void *buf, size_t n)
+{
+    output_flush_hole(o);
+    if (o->flac)
+        output_flac(o, buf, n);
+    else
+        output_append(o, buf, n);
+}
+
+// convert and write s samples at the output rate
+// x2 = the right channel in stereo, with x the left; NULL in mono
+static void output_write(struct output *o, const float *x, const float *x2, unsigned int s)
+{
+    if (x2)
+        convert_float_stereo(o->conv, x, x2, s, o->format);
+    else
+        convert_float(o->conv, x, s, o->format);
+    output_bytes(o, o->conv, (size_t)s * o->channels * format_size[o->format]);
+}
+
+// write s samples of each channel, at the internal rate
+static void output_samples_n(struct output *o, const float *x, const float *x2, unsigned int s)
+{
+    o->quiet = 0;
+    if (o->dec[0])
+    {
+        decimate(o->dec[0], x, s, o->dec_buffer[0]);
+        if (x2)
+            decimate(o->dec[1], x2, s, o->dec_buffer[1]);
+        s /= o->dec[0]->m;
+        x = o->dec_buffer[0];
+        x2 = x2? o->dec_buffer[1] : NULL;
+    }
+    if (o->lim)
+    {
+        limit(o->lim, x, x2, s, o->lim_buffer[0], o->lim_buffer[1]);
+        x = o->lim_buffer[0];
+        x2 = x2? o->lim_buffer[1] : NULL;
+    }
+    unsigned int drop = (o->skip < s)? o->skip : s;
+    o->skip -= drop;
+    output_write(o, x + drop, x2? x2 + drop : NULL, s - drop);
+}
+
+// write s samples, at the internal rate
+void output_samples(struct output *o, const float *x, unsigned int s)
+{
+    output_samples_n(o, x, NULL, s);
+}
+
+// write s samples of a left and a right channel, at the internal rate
+void output_samples_stereo(struct output *o, const float *l, const float *r, unsigned int s)
+{
+    output_samples_n(o, l, r, s);
+}
+
+// write s samples of silence on every channel, at the internal rate
+static void output_zero(struct output *o, unsigned int s)
+{
+    output_samples_n(o, o->zero, (o->channels > 1)? o->zero : NULL, s);
+}
+
+// write s Q15 samples from the fixed-point path
+void output_samples_fixed(struct output *o, const int32_t *x, unsigned int s)
+{
+    convert_fixed(o->conv, x, s, o->format);
+    output_bytes(o, o->conv, (size_t)s * format_size[o->format]);
+}
+
+void output_samples_fixed_stereo(struct output *o, const int32_t *l, const int32_t *r, unsigned int s)
+{
+    convert_fixed_stereo(o->conv, l, r, s, o->format);
+    output_bytes(o, o->conv, (size_t)s * 2 * format_size[o->format]);
+}
+
+// write s samples of silence, at the internal rate
+// Zero samples are zero bytes in every format, so runs of silence are only
+// counted here and later become a hole in the file, or one large write.
+void output_silence(struct output *o, uint64_t s)
+{
+    if (o->dec[0] || o->lim)
+    {
+        // the filter rings on, and the limiter holds back sound, until a
+        // full window of silence has gone in
+        const unsigned int m = o->dec[0]? o->dec[0]->m : 1;
+        const unsigned long window = (unsigned long)m
+            * ((o->dec[0]? DECIMATOR_TAPS : 0) + (o->lim? o->lim->d + 1 : 0));
+        while (s && o->quiet < window)
+        {
+            unsigned int n = (s < o->max_block)? s : o->max_block;
+            n = (n < window - o->quiet)? n : window - o->quiet;
+            output_zero(o, n);
+            o->quiet += n;
+            s -= n;
+        }
+        s /= m;
+        if (o->lim)
+            limiter_skip(o->lim, s);
+        uint64_t drop = (o->skip < s)? o->skip : s;
+        o->skip -= drop;
+        s -= drop;
+    }
+    o->hole += s * o->channels * format_size[o->format];
+    o->silent += s;
+}
+
+// write out everything so far, for a consumer that is listening live
+void output_flush(struct output *o)
+{
+    output_flush_hole(o);
+    // the whole FLAC frames so far, encoded now
+    if (o->flac && flac_filling(o->flac)->count >= FLAC_BLOCK * o->flac->channels)
+        output_flac_queue(o, 0, 1);
+    // direct I/O only takes whole blocks until the end
+    if (!o->direct)
+        writer_submit(&o->w, o->pos);
+}
+
+// flush and close the output
+// returns non-zero if there is an error
+int output_close(struct output *o)
+{
+    int err = 0;
+    const int dec = o->dec[o->channels - 1] && o->dec_buffer[o->channels - 1];
+    const int lim = o->lim && o->lim->d && o->lim_buffer[o->channels - 1];
+    if ((dec || lim) && o->zero)
+    {
+        // push the samples still inside the filter and the limiter out with
+        // silence
+        const unsigned int m = dec? o->dec[0]->m : 1, max_out = o->max_block / m;
+        unsigned int left = (dec? decimator_delay() : 0) + (lim? o->lim->d : 0);
+        while (left)
+        {
+            unsigned int n = (left < max_out)? left : max_out;
+            output_zero(o, n * m);
+            left -= n;
+        }
+    }
+    if (o->w.blocks[WRITER_BLOCKS - 1].data)
+    {
+        // a trailing hole only needs the file extended to cover it
+        output_flush_hole(o);
+        if (o->flac)
+            output_flac_queue(o, 1, 1); // the rest, ending on a short frame
+        const uint64_t data = o->pos - ((o->container == CONTAINER_WAV)? WAV_HEADER_SIZE : 0);
+        if (o->container == CONTAINER_WAV && (data & 1))
+            output_append(o, "", 1); // chunks are padded to an even size
+        uint64_t end = o->pos;
+        if (o->direct)
+        {
+            // pad the last block to the alignment, and cut the file back
+            struct out_block *b = writer_block(&o->w);
+            size_t pad = -b->len & (DIRECT_ALIGN - 1);
+            memset(b->data + b->len, 0, pad);
+            b->len += pad;
+            o->pos += pad;
+        }
+        int werr = writer_finish(&o->w, o->pos);
+        if (werr)
+        {
+            fprintf(stderr, "write: %s\n", strerror(werr));
+            err = 1;
+        }
+        if (o->seekable && ftruncate(o->fd, end))
+        {
+            perror("ftruncate");
+            err = 1;
+        }
+        if (o->container != CONTAINER_RAW && !err)
+            err = output_fixup(o, data);
+        if (o->v && o->flac)
+        {
+            const uint64_t raw = o->flac->samples * o->flac->channels * format_size[o->format];
+            fprintf(stderr, "flac: %llu samples in %llu bytes, %.1f%% of the raw size\n",
+                    (unsigned long long)o->flac->samples,
+                    (unsigned long long)(end - FLAC_HEADER_SIZE),
+                    raw? 100.0 * (end - FLAC_HEADER_SIZE) / raw : 0.0);
+        }
+        if (o->v)
+            fprintf(stderr, "writer: %llu blocks of up to %zu bytes%s%s, "
+                    "rendering waited for the disk %llu times\n",
+                    (unsigned long long)o->w.filled, o->w.block_size,
+                    o->w.direct? " with direct I/O" : "",
+                    o->w.uring? " through io_uring" : "",
+                    (unsigned long long)o->w.stalls);
+    }
+    if (o->v && lim)
+        fprintf(stderr, "limiter: lowest gain %.1f dB\n", 20 * log10f(o->lim->lowest));
+    if (o->v && o->silent)
+        fprintf(stderr, "silence fast path: %llu samples %s\n",
+                (unsigned long long)o->silent,
+                o->sparse? "left as holes" : "written in bulk");
+    if (o->fd > STDOUT_FILENO && close(o->fd))
+    {
+        perror("close");
+        err = 1;
+    }
+    writer_free(&o->w);
+    for (unsigned int ch = 0; ch < 2; ch++)
+    {
+        if (o->dec[ch])
+            decimator_free(o->dec[ch]);
+        free(o->dec[ch]);
+        free(o->dec_buffer[ch]);
+        free(o->lim_buffer[ch]);
+    }
+    if (o->lim)
+        limiter_free(o->lim);
+    free(o->lim);
+    free(o->zero);
+    free(o->conv);
+    free(o->fill);
+    if (o->flac)
+        flac_free(o->flac);
+    free(o->flac);
+    return err;
+}
+
+// score file layout, all little-endian:
+//     struct score_header
+//     uint32_t index[columns + 1]
+//     struct score_event events[events]
+// The events of column x are events[index[x]] up to events[index[x + 1]],
+// in the order they are mixed. A mapped file is used in place, so the
+// fields are read as they are; a big-endian host sees a wrong version.
+#define SCORE_MAGIC "ITSSCORE"
+// Version 1 had a reserved 0 in place of pan, which reads as the centre.
+#define SCORE_VERSION 2
+struct score_header {
+    char magic[8]; // SCORE_MAGIC
+    uint32_t version; // SCORE_VERSION
+    uint32_t columns; // number of columns
+    uint32_t events; // number of events in all columns
+    uint32_t reserved; // 0
+};
+
+// one note in one column
+struct score_event {
+    uint8_t key; // piano key, 1 to NUM_KEYS
+    uint8_t wave; // WAVE_*
+    uint8_t level; // amplitude, 1 to 255
+    int8_t pan; // stereo position from the colour, -127 (left) to 127 (right)
+};
+
+// the notes to play, column by column
+struct score {
+    uint32_t columns; // number of columns
+    const uint32_t *index; // first event of each column, columns + 1 entries
+    const struct score_event *events; // events of all columns
+    void *map; // score file mapping, or NULL
+    size_t map_len; // length of the mapping
+    void *buf; // index and events built in memory, or NULL
+};
+
+// check whether a file starts like a score
+// Only regular files can be scores, as scores are mapped; a pipe is left
+// unread for the image decoder.
+int score_detect(const char *filename)
+{
+    char magic[sizeof(((struct score_header *)0)->magic)];
+    struct stat st;
+    if (stat(filename, &st) || !S_ISREG(st.st_mode))
+        return 0;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return 0;
+    int found = fread(magic, sizeof(magic), 1, fp) == 1
+        && memcmp(magic, SCORE_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+    return found;
+}
+
+// map a score file
+// Nothing is decoded; the index and the events are only checked, for bounds
+// and for a key played twice with one waveform in a column, so the renderer
+// can trust them.
+// returns non-zero if there is an error
+int score_map(struct score *sc, const char *filename)
+{
+    memset(sc, 0, sizeof(*sc));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "could not load input file\n");
+        return 1;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct score_header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "could not load input file\n");
+        return 1;
+    }
+    sc->map = map;
+    sc->map_len = st.st_size;
+    const struct score_header *hd = map;
+    if (hd->version < 1 || hd->version > SCORE_VERSION)
+    {
+        fprintf(stderr, "unsupported score version %u\n", hd->version);
+        return 1;
+    }
+    const uint64_t index_len = ((uint64_t)hd->columns + 1) * sizeof(uint32_t);
+    if (st.st_size != sizeof(*hd) + index_len + (uint64_t)hd->events * sizeof(struct score_event))
+    {
+        fprintf(stderr, "score file has the wrong size\n");
+        return 1;
+    }
+    sc->columns = hd->columns;
+    sc->index = (const uint32_t *)(hd + 1);
+    sc->events = (const struct score_event *)((const char *)sc->index + index_len);
+    if (sc->index[0] != 0 || sc->index[sc->columns] != hd->events)
+    {
+        fprintf(stderr, "bad score index\n");
+        return 1;
+    }
+    for (uint32_t x = 0; x < sc->columns; x++)
+    {
+        if (sc->index[x + 1] < sc->index[x] || sc->index[x + 1] - sc->index[x] > NUM_KEYS)
+        {
+            fprintf(stderr, "bad score index at column %u\n", x);
+            return 1;
+        }
+    }
+    for (uint32_t x = 0; x < sc->columns; x++)
+    {
+        uint8_t waves[NUM_KEYS + 1] = {0}; // waveforms seen on each key, a bit each
+        for (uint32_t i = sc->index[x]; i < sc->index[x + 1]; i++)
+        {
+            const struct score_event *e = &sc->events[i];
+            if (!e->key || e->key > NUM_KEYS || e->wave > WAVE_SQUARE)
+            {
+                fprintf(stderr, "bad score event %u\n", i);
+                return 1;
+            }
+            if (waves[e->key] & (1 << e->wave))
+            {
+                fprintf(stderr, "score event %u plays a note twice in column %u\n", i, x);
+                return 1;
+            }
+            waves[e->key] |= 1 << e->wave;
+        }
+    }
+    return 0;
+}
+
+// most threads used to extract notes
+#define MAX_THREADS 64
+
+// one thread's share of score_from_image()
+struct extract {
+    const unsigned char *data; // image data, frames one below the other
+    int w, h, n; // frame width, frame height, number of channels
+    unsigned int frames; // number of frames
+    const struct config *c;
+    uint32_t *index; // note count, then first event, of each output column
+    struct score_event *events; // events to fill in, or NULL to count
+    uint32_t begin, end; // output columns of this share
+};
+
+// notes of one output column
+// n = number of channels
+// With FRAMES_LAYER every frame plays at once and the loudest frame on a key
+// wins; otherwise frames follow each other in time.
+// e = where to put the events, or NULL to count them
+static inline __attribute__((always_inline)) unsigned int column_notes_n(
+        const struct extract *ex, uint32_t col, struct score_event *e, const int n)
+{
+    // locals, as the stores to e could alias anything reached through ex
+    const int wave = ex->c->wave, layer = ex->c->frames == FRAMES_LAYER;
+    const int colour_pan = n >= 3 && ex->c->pan == PAN_COLOUR;
+    const unsigned int ox = ex->c->ox, oy = ex->c->oy, cols = ex->w - ox;
+    const int end_y = (ex->h - oy < NUM_KEYS)? ex->h : (oy + NUM_KEYS);
+    const unsigned int f0 = layer? 0 : col / cols, frames = layer? ex->frames : 1;
+    const unsigned int x = ox + (layer? col : col % cols);
+    const size_t stride = (size_t)ex->w * n, frame_size = stride * ex->h;
+    const unsigned char *top = ex->data + f0 * frame_size + (size_t)x * n;
+    unsigned int count = 0;
+    for (int y = oy; y < end_y; y++)
+    {
+        const unsigned char *row = top + y * stride, *p = row;
+        unsigned char level = pixel_level(p, n);
+        for (unsigned int f = 1; f < frames; f++)
+        {
+            const unsigned char *q = row + f * frame_size;
+            unsigned char l = pixel_level(q, n);
+            if (l > level)
+            {
+                level = l;
+                p = q;
+            }
+        }
+        if (!e)
+        {
+            // only counting
+            count += level != 0;
+            continue;
+        }
+        if (!level)
+        {
+            // silence
+            continue;
+        }
+        // add a note
+        e[count].key = NUM_KEYS - (y - oy);
+        e[count].wave = (n < 3)? wave : color_to_wave(p[0], p[1], p[2]);
+        e[count].level = level;
+        e[count].pan = colour_pan? color_to_pan(p[1], p[2]) : 0;
+        count++;
+    }
+    return count;
+}
+
+// column_notes_n() with a copy for RGB, the common case, where the channel
+// count is a constant
+static inline __attribute__((always_inline)) unsigned int column_notes(
+        const struct extract *ex, uint32_t col, struct score_event *e)
+{
+    if (ex->n == 3)
+        return column_notes_n(ex, col, e, 3);
+    return column_notes_n(ex, col, e, ex->n);
+}
+
+static void *extract_thread(void *arg)
+{
+    struct extract *ex = arg;
+    for (uint32_t col = ex->begin; col < ex->end; col++)
+    {
+        if (ex->events)
+            column_notes(ex, col, ex->events + ex->index[col]);
+        else
+            ex->index[col + 1] = column_notes(ex, col, NULL);
+    }
+    return NULL;
+}
+
+// run extract_thread() over all shares, in parallel where possible
+static void extract_run(struct extract *ex, unsigned int count)
+{
+    pthread_t threads[MAX_THREADS];
+    char started[MAX_THREADS] = {0};
+    for (unsigned int t = 1; t < count; t++)
+        started[t] = pthread_create(&threads[t], NULL, extract_thread, &ex[t]) == 0;
+    extract_thread(&ex[0]);
+    for (unsigned int t = 1; t < count; t++)
+    {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        else
+            extract_thread(&ex[t]);
+    }
+}
+
+// extract the notes of an image
+// data = image data, w = width, h = height, n = number of channels
+// frames = number of frames, stored one below the other
+// Columns start at c->ox and keys count down from the top row at c->oy;
+// 1- and 2-channel images are gray levels and play on c->wave. The columns
+// are split between threads, which count the notes of their columns and,
+// once the index is laid out, write them.
+// returns non-zero if there is an error
+int score_from_image(
+        struct score *sc, const unsigned char *data, int w, int h, int n,
+        unsigned int frames, const struct config *c)
+{
+    memset(sc, 0, sizeof(*sc));
+    const uint32_t cols = w - c->ox;
+    sc->columns = (c->frames == FRAMES_LAYER)? cols : cols * frames;
+    uint32_t *index = malloc(((size_t)sc->columns + 1) * sizeof(*index));
+    if (!index)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    // split the columns evenly, a few hundred at least per thread
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads = sc->columns / 256 + 1;
+    if (cpus > 0 && threads > cpus)
+        threads = cpus;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    struct extract ex[MAX_THREADS];
+    for (unsigned int t = 0; t < threads; t++)
+    {
+        ex[t] = (struct extract){
+            .data = data, .w = w, .h = h, .n = n, .frames = frames, .c = c,
+            .index = index,
+            .begin = (uint64_t)sc->columns * t / threads,
+            .end = (uint64_t)sc->columns * (t + 1) / threads,
+        };
+    }
+    if (c->v && (frames > 1 || threads > 1))
+        fprintf(stderr, "extracting notes of %u frame%s with %u thread%s\n",
+                frames, (frames > 1)? "s" : "", threads, (threads > 1)? "s" : "");
+
+    // count the notes first to size the buffer in one go
+    index[0] = 0;
+    extract_run(ex, threads);
+    for (uint32_t col = 0; col < sc->columns; col++)
+        index[col + 1] += index[col];
+    const uint32_t events = index[sc->columns];
+    const size_t index_len = ((size_t)sc->columns + 1) * sizeof(uint32_t);
+    void *buf = realloc(index, index_len + (size_t)events * sizeof(struct score_event));
+    if (!buf)
+    {
+        fprintf(stderr, "out of memory\n");
+        free(index);
+        return 1;
+    }
+    sc->buf = buf;
+    sc->index = sc->buf;
+    sc->events = (const struct score_event *)((char *)sc->buf + index_len);
+    for (unsigned int t = 0; t < threads; t++)
+    {
+        ex[t].index = sc->buf;
+        ex[t].events = (struct score_event *)sc->events;
+    }
+    extract_run(ex, threads);
+    return 0;
+}
+
+// write a score file
+// returns non-zero if there is an error
+int score_write(const struct score *sc, const char *filename)
+{
+    // the score may start part way into a mapped file
+    const uint32_t first = sc->index[0], events = sc->index[sc->columns] - first;
+    const struct score_header hd = {
+        .magic = SCORE_MAGIC,
+        .version = SCORE_VERSION,
+        .columns = sc->columns,
+        .events = events,
+    };
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        perror("fopen");
+        return 1;
+    }
+    int err = fwrite(&hd, sizeof(hd), 1, fp) != 1;
+    for (uint32_t x = 0; !err && x <= sc->columns; x++)
+    {
+        uint32_t i = sc->index[x] - first;
+        err = fwrite(&i, sizeof(i), 1, fp) != 1;
+    }
+    if (!err)
+        err = fwrite(sc->events + first, sizeof(struct score_event), events, fp) != events;
+    if (fclose(fp))
+        err = 1;
+    if (err)
+        fprintf(stderr, "could not write output file\n");
+    return err;
+}
+
+void score_free(struct score *sc)
+{
+    if (sc->map)
+        munmap(sc->map, sc->map_len);
+    free(sc->buf);
+}
+
+// methods compared by bench_output()
+enum {
+    BENCH_FWRITE, // stdio
+    BENCH_PWRITE, // pwrite() from the render loop
+    BENCH_THREAD, // the writer thread
+    BENCH_URING, // io_uring
+};
+
+// write size bytes with one method to a new file in the current directory
+// returns the seconds until the last write returned and until the data was
+// on disk, or a negative time if the method is not available
+static void bench_write(int method, char direct, size_t block_size, size_t size,
+        double *t_write, double *t_sync)
+{
+    char name[] = "img_to_sound-bench-XXXXXX";
+    int fd = mkstemp(name);
+    *t_write = *t_sync = -1;
+    if (fd < 0)
+        return;
+    unlink(name);
+    if (direct && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT))
+    {
+        close(fd);
+        return;
+    }
+    void *buf;
+    if (posix_memalign(&buf, DIRECT_ALIGN, block_size))
+    {
+        close(fd);
+        return;
+    }
+    memset(buf, 0x55, block_size);
+
+    double t0 = now();
+    int err = 0;
+    if (method == BENCH_FWRITE)
+    {
+        FILE *fp = fdopen(fd, "w");
+        for (size_t done = 0; fp && done < size; done += block_size)
+            err |= fwrite(buf, 1, block_size, fp) != block_size;
+        err |= !fp || fflush(fp);
+        *t_write = now() - t0;
+        err |= fsync(fd);
+        if (fp)
+            fclose(fp);
+        fd = -1;
+    }
+    else if (method == BENCH_PWRITE)
+    {
+        for (size_t done = 0; done < size; done += block_size)
+            err |= pwrite(fd, buf, block_size, done) != block_size;
+        *t_write = now() - t0;
+        err |= fsync(fd);
+    }
+    else
+    {
+        // through the output stage's writer, as a render would
+        struct writer w;
+        if (writer_init(&w, fd, 1, direct, block_size, method == BENCH_URING)
+                || (method == BENCH_URING && !w.uring))
+        {
+            writer_free(&w);
+            free(buf);
+            close(fd);
+            return;
+        }
+        for (size_t done = 0; done < size; done += block_size)
+        {
+            memcpy(writer_block(&w)->data, buf, block_size);
+            writer_block(&w)->len = block_size;
+            writer_submit(&w, done + block_size);
+        }
+        err |= writer_finish(&w, size);
+        *t_write = now() - t0;
+        err |= fsync(fd);
+        writer_free(&w);
+    }
+    *t_sync = now() - t0;
+    if (err)
+        *t_write = *t_sync = -1;
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+}
+
+// compare the ways of writing the output, in the current directory
+void bench_output(FILE *fp, size_t block_size)
+{
+    static const char *names[] = {
+        [BENCH_FWRITE] = "fwrite",
+        [BENCH_PWRITE] = "pwrite",
+        [BENCH_THREAD] = "thread",
+        [BENCH_URING] = "io_uring",
+    };
+    const size_t size = (size_t)256 << 20;
+    fprintf(fp, "\n%-10s %-8s %16s %16s\n", "writes", "cache", "MB/s written", "MB/s on disk");
+    for (int direct = 0; direct < 2; direct++)
+    {
+        for (int m = 0; m < sizeof(names) / sizeof(*names); m++)
+        {
+            if (direct && m == BENCH_FWRITE)
+                continue;
+            double t_write, t_sync;
+            bench_write(m, direct, block_size, size, &t_write, &t_sync);
+            if (t_write < 0)
+                fprintf(fp, "%-10s %-8s %16s %16s\n", names[m],
+                        direct? "direct" : "page", "n/a", "n/a");
+            else
+                fprintf(fp, "%-10s %-8s %16.0f %16.0f\n", names[m],
+                        direct? "direct" : "page", size / t_write / 1e6, size / t_sync / 1e6);
+        }
+    }
+}
+
+// synthesis state carried from column to column while rendering notes
+struct note_renderer {
+    const struct config *c;
+    const mix_fn *kernels; // float kernels, by WAVE_*
+    const mix_stereo_fn *stereo_kernels; // the same, in stereo
+    float gain; // applied to every note
+    float *col_buffer; // mixed float samples of a column
+    int32_t *fixed_buffer; // mixed Q15 samples of a column
+    float *col_right; // right channel of col_buffer, in stereo
+    int32_t *fixed_right; // right channel of fixed_buffer, in stereo
+    struct voice notes[MAX_VOICES]; // notes of the current column, then released ones
+    struct voice_pool pool;
+    struct envelope env; // used when c->envelope is set
+    uint64_t s0; // sample index of the column start
+    uint64_t column; // index of the current column
+};
+
+// gain of each note when at most <voices> notes play at once
+// Without the limiter a full column must not clip. With it, notes only add up
+// to the full range on average, which is about the square root of their
+// number for unrelated notes, and the limiter catches the peaks.
+float notes_gain(unsigned int voices, const struct config *c)
+{
+    return c->limit? 1 / sqrtf(voices) : 1.0 / voices;
+}
+
+// returns non-zero if there is an error
+int notes_init(struct note_renderer *r, float gain, const struct config *c)
+{
+    memset(r, 0, sizeof(*r));
+    r->c = c;
+    r->gain = gain;
+    r->kernels = c->bandlimit? bandlimited_kernels : naive_kernels;
+    r->stereo_kernels = c->bandlimit? bandlimited_stereo_kernels : naive_stereo_kernels;
+    envelope_init(&r->env, c->attack, c->decay, c->sustain, c->release, c->rate);
+    // the fixed-point path mixes into Q15 integers instead
+    if (c->fixed)
+    {
+        r->fixed_buffer = malloc(c->spp * sizeof(*r->fixed_buffer));
+        if (c->pan)
+            r->fixed_right = malloc(c->spp * sizeof(*r->fixed_right));
+    }
+    else
+    {
+        r->col_buffer = malloc(c->spp * sizeof(*r->col_buffer));
+        if (c->pan)
+            r->col_right = malloc(c->spp * sizeof(*r->col_right));
+    }
+    if ((!r->col_buffer && !r->fixed_buffer) || (c->pan && !r->col_right && !r->fixed_right))
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    return 0;
+}
+
+// key a note plays on in a preview: octaves lower until it is below
+// PREVIEW_MAX_PITCH of the preview rate, where it would otherwise alias to
+// a pitch of its own
+static inline int preview_key(int key, int wave, unsigned int rate)
+{
+    while (key > 12 && wave_cycles(wave, key_to_frequency(key)) > rate * PREVIEW_MAX_PITCH)
+        key -= 12;
+    return key;
+}
+
+// render the next column
+// e = notes of the column, count = number of notes
+void notes_column(
+        struct note_renderer *r, struct output *out,
+        const struct score_event *e, unsigned int count)
+{
+    const struct config *c = r->c;
+    const unsigned int spp = c->spp;
+    const unsigned int max_notes = c->max_notes? c->max_notes : NUM_KEYS;
+    // a key has at most one voice per waveform, so notes that land on the same
+    // one (an octave apart in a preview, say) play the loudest of them
+    uint8_t slot[(NUM_KEYS + 1) * 4] = {0}; // note index + 1 by key and waveform
+    unsigned int n = 0; // notes after merging
+    for (unsigned int i = 0; i < count; i++)
+    {
+        const int key = c->preview? preview_key(e[i].key, e[i].wave, c->rate) : e[i].key;
+        const float amp = e[i].level / 255.0f * r->gain;
+        uint8_t *s = &slot[key * 4 + e[i].wave];
+        if (*s)
+        {
+            r->notes[*s - 1].amp = fmaxf(r->notes[*s - 1].amp, amp);
+            continue;
+        }
+        *s = n + 1;
+        r->notes[n].key = key;
+        r->notes[n].wave = e[i].wave;
+        r->notes[n].amp = amp;
+        // low keys on the left and high keys on the right, or as coloured
+        r->notes[n].pan = (c->pan == PAN_PITCH)?
+            (e[i].key - 1) * (2.0f / (NUM_KEYS - 1)) - 1 : e[i].pan / 127.0f;
+        n++;
+    }
+    if (n > max_notes && c->v)
+        fprintf(stderr, "note: %u notes in column %llu, keeping %u\n",
+                n, (unsigned long long)r->column, max_notes);
+    const struct envelope *env = c->envelope? &r->env : NULL;
+    pool_update(&r->pool, r->notes, n, max_notes, c->priority, r->s0, c->rate, env);
+    r->s0 += spp;
+    r->column++;
+    if (!r->pool.count)
+    {
+        // a rest with nothing left sounding
+        output_silence(out, spp);
+        return;
+    }
+    // mix and write current range to file
+    if (c->pan && c->fixed)
+    {
+        memset(r->fixed_buffer, 0, spp * sizeof(*r->fixed_buffer));
+        memset(r->fixed_right, 0, spp * sizeof(*r->fixed_right));
+        mix_voices_fixed_stereo(r->fixed_buffer, r->fixed_right, r->pool.voices, r->pool.count, spp);
+        output_samples_fixed_stereo(out, r->fixed_buffer, r->fixed_right, spp);
+    }
+    else if (c->pan)
+    {
+        memset(r->col_buffer, 0, spp * sizeof(*r->col_buffer));
+        memset(r->col_right, 0, spp * sizeof(*r->col_right));
+        mix_voices_stereo(r->col_buffer, r->col_right, r->pool.voices, r->pool.count, spp,
+                r->stereo_kernels, env);
+        output_samples_stereo(out, r->col_buffer, r->col_right, spp);
+    }
+    else if (c->fixed)
+    {
+        memset(r->fixed_buffer, 0, spp * sizeof(*r->fixed_buffer));
+        mix_voices_fixed(r->fixed_buffer, r->pool.voices, r->pool.count, spp);
+        output_samples_fixed(out, r->fixed_buffer, spp);
+    }
+    else
+    {
+        memset(r->col_buffer, 0, spp * sizeof(*r->col_buffer));
+        mix_voices(r->col_buffer, r->pool.voices, r->pool.count, spp, r->kernels, env);
+        output_samples(out, r->col_buffer, spp);
+    }
+}
+
+void notes_free(struct note_renderer *r)
+{
+    if (r->c->v && r->pool.stolen)
+        fprintf(stderr, "notes dropped by the polyphony limit: %lu\n", r->pool.stolen);
+    free(r->col_buffer);
+    free(r->fixed_buffer);
+    free(r->col_right);
+    free(r->fixed_right);
+}
+
+// level --normalize rms aims for, -20 dBFS
+#define NORMALIZE_TARGET_RMS 0.1f
+
+// peak and RMS of each waveform at an amplitude of 1
+static const float wave_peak[] = {
+    [WAVE_SINE] = 1,
+    [WAVE_SAW] = 0.5f,
+    [WAVE_TRIANGLE] = 0.5f,
+    [WAVE_SQUARE] = 1,
+};
+static const float wave_rms[] = {
+    [WAVE_SINE] = 0.70711f,
+    [WAVE_SAW] = 0.28868f,
+    [WAVE_TRIANGLE] = 0.28868f,
+    [WAVE_SQUARE] = 1,
+};
+
+// estimate the levels of a score at a note gain of 1 from its notes alone,
+// without rendering it
+// peak = the highest sum of note peaks in a column, which the waves can reach
+// but never exceed
+// rms = RMS over the columns that have notes, taking notes on different keys
+// as unrelated so their powers add
+void score_levels(const struct score *sc, const struct config *c, float *peak, float *rms)
+{
+    const unsigned int max_notes = c->max_notes? c->max_notes : NUM_KEYS;
+    struct voice notes[NUM_KEYS];
+    double power = 0;
+    uint32_t sounding = 0;
+    *peak = 0;
+    for (uint32_t x = 0; x < sc->columns; x++)
+    {
+        const struct score_event *e = sc->events + sc->index[x];
+        unsigned int count = sc->index[x + 1] - sc->index[x];
+        if (!count)
+            continue;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            notes[i].key = e[i].key;
+            notes[i].wave = e[i].wave;
+            notes[i].amp = e[i].level / 255.0f;
+        }
+        // the same notes the renderer keeps
+        count = select_notes(notes, count, max_notes, c->priority);
+        float sum = 0;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            const float a = notes[i].amp * wave_rms[notes[i].wave];
+            sum += notes[i].amp * wave_peak[notes[i].wave];
+            power += a * a;
+        }
+        *peak = (sum > *peak)? sum : *peak;
+        sounding++;
+    }
+    *rms = sounding? sqrt(power / sounding) : 0;
+}
+
+// the most notes that ever play at once under the polyphony limit, at least 1
+// silent = set to the number of columns without notes
+unsigned int peak_polyphony(const struct score *sc, const struct config *c, unsigned int *silent)
+{
+    const unsigned int max_notes = c->max_notes? c->max_notes : NUM_KEYS;
+    unsigned int peak = 1;
+    *silent = 0;
+    for (uint32_t x = 0; x < sc->columns; x++)
+    {
+        unsigned int notes = sc->index[x + 1] - sc->index[x];
+        *silent += !notes;
+        if (notes > max_notes)
+            notes = max_notes;
+        if (notes > peak)
+            peak = notes;
+    }
+    return peak;
+}
+
+// render a score as notes on piano keys
+int render_notes(struct output *out, const struct score *sc, const struct config *c)
+{
+    // the most notes that ever play at once sets the gain so the loudest
+    // column uses the full range without clipping
+    unsigned int silent;
+    const unsigned int peak = peak_polyphony(sc, c, &silent);
+    if (c->v)
+        fprintf(stderr, "peak polyphony: %u, silent columns: %u of %u\n",
+                peak, silent, sc->columns);
+    float gain = notes_gain(peak, c);
+    if (c->normalize)
+    {
+        float peak_level, rms;
+        score_levels(sc, c, &peak_level, &rms);
+        if (peak_level > 0)
+        {
+            // at most the gain that keeps the loudest column under the
+            // ceiling, unless the limiter takes care of the peaks
+            const float max_gain = LIMITER_CEILING / peak_level;
+            gain = max_gain;
+            if (c->normalize == NORMALIZE_RMS && (c->limit || NORMALIZE_TARGET_RMS / rms < max_gain))
+                gain = NORMALIZE_TARGET_RMS / rms;
+        }
+        if (c->v)
+            fprintf(stderr, "normalize: peak %.1f dB, rms %.1f dB before a gain of %.1f dB\n",
+                    20 * log10f(peak_level), 20 * log10f(rms), 20 * log10f(gain));
+    }
+
+    struct note_renderer r;
+    if (notes_init(&r, gain, c))
+    {
+        notes_free(&r);
+        return 1;
+    }
+    // process each column
+    for (uint32_t x = 0; x < sc->columns; x++)
+        notes_column(&r, out, sc->events + sc->index[x], sc->index[x + 1] - sc->index[x]);
+    notes_free(&r);
+    return 0;
+}
+
+// render the image as a spectrogram
+// Every row from oy down is a frequency bin (top = Nyquist, bottom = DC) and
+// every column is a magnitude spectrum, resynthesized with an inverse FFT and
+// overlap-add.
+int render_spectrogram(
+        struct output *out, const unsigned char *data, int w, int h, int n,
+        const struct config *c)
+{
+    const unsigned int spp = c->spp, fft_size = c->fft_size, hop = c->hop;
+    const unsigned int ox = c->ox, oy = c->oy;
+    const unsigned int rows = h - oy, cols = w - ox;
+    const unsigned int bins = fft_size / 2;
+
+    struct spectro s;
+    if (spectro_init(&s, fft_size, hop))
+    {
+        fprintf(stderr, "out of memory\n");
+        spectro_free(&s);
+        return 1;
+    }
+    // acc holds the overlap-added output from sample position base onwards
+    const size_t acc_len = spp + 2 * fft_size;
+    float *acc = calloc(acc_len, sizeof(float));
+    float *mag = malloc(bins * sizeof(float));
+    // bin k reads the rows at the same relative height, from bin_row[k] down
+    // <bin_rows[k]> rows, and takes the loudest; with fewer rows than bins,
+    // one row each
+    unsigned int *bin_row = malloc(2 * bins * sizeof(*bin_row));
+    unsigned int *bin_rows = bin_row + bins;
+    if (!acc || !mag || !bin_row)
+    {
+        fprintf(stderr, "out of memory\n");
+        free(acc);
+        free(mag);
+        free(bin_row);
+        spectro_free(&s);
+        return 1;
+    }
+    for (unsigned int k = 0; k < bins; k++)
+    {
+        // rows [j0, j1) counted from the bottom
+        const unsigned int j0 = (uint64_t)k * rows / bins;
+        unsigned int j1 = (uint64_t)(k + 1) * rows / bins;
+        j1 = (j1 > j0)? j1 : j0 + 1;
+        bin_row[k] = rows - j1;
+        bin_rows[k] = j1 - j0;
+    }
+
+    // find the silent columns up front, so their frames can be skipped
+    unsigned char *lit = calloc(cols, 1);
+    if (!lit)
+    {
+        fprintf(stderr, "out of memory\n");
+        free(acc);
+        free(mag);
+        free(bin_row);
+        spectro_free(&s);
+        return 1;
+    }
+    unsigned int silent = 0;
+    for (unsigned int col = 0; col < cols; col++)
+    {
+        for (unsigned int y = oy; y < h && !lit[col]; y++)
+        {
+            lit[col] = pixel_level(data + ((size_t)y * w + ox + col) * n, n) != 0;
+        }
+        silent += !lit[col];
+    }
+
+    if (c->v)
+        fprintf(stderr, "spectrogram: %u rows onto %u bins, FFT size %u, hop %u, "
+                "silent columns: %u of %u\n", rows, bins, fft_size, hop, silent, cols);
+
+    // frames are centered at multiples of hop; the first frame starts half a
+    // window before the output does
+    int64_t base = -(int64_t)(fft_size / 2);
+    uint64_t center = 0;
+    uint64_t sound_end = 0; // where the last frame with any sound ends
+    int last_col = -1;
+    for (unsigned int col = 0; col < cols; col++)
+    {
+        const uint64_t col_end = (uint64_t)(col + 1) * spp;
+        // add every frame that overlaps this column
+        while ((int64_t)center - (int64_t)(fft_size / 2) < (int64_t)col_end)
+        {
+            uint64_t frame_col = center / spp;
+            if (frame_col < cols && lit[frame_col])
+            {
+                if ((int)frame_col != last_col)
+                {
+                    // read this column's spectrum
+                    unsigned int x = ox + frame_col;
+                    for (unsigned int k = 0; k < bins; k++)
+                    {
+                        unsigned char level = 0;
+                        for (unsigned int j = 0; j < bin_rows[k]; j++)
+                        {
+                            const unsigned char *p =
+                                data + ((size_t)(oy + bin_row[k] + j) * w + x) * n;
+                            const unsigned char l = pixel_level(p, n);
+                            level = (l > level)? l : level;
+                        }
+                        mag[k] = level / 255.0f;
+                    }
+                    last_col = frame_col;
+                }
+                int64_t off = (int64_t)center - fft_size / 2 - base;
+                spectro_frame(&s, mag, acc + off, center);
+                sound_end = center + fft_size / 2;
+            }
+            center += hop;
+        }
+        int64_t off = (int64_t)col * spp - base;
+        size_t used = off + spp;
+        if ((uint64_t)col * spp >= sound_end)
+        {
+            // nothing reaches this column, and the accumulator is all zero
+            output_silence(out, spp);
+            base += used;
+            continue;
+        }
+        // emit this column and slide the accumulator
+        output_samples(out, acc + off, spp);
+        memmove(acc, acc + used, (acc_len - used) * sizeof(float));
+        memset(acc + acc_len - used, 0, used * sizeof(float));
+        base += used;
+    }
+
+    free(acc);
+    free(mag);
+    free(bin_row);
+    free(lit);
+    spectro_free(&s);
+    return 0;
+}
+
+// a decoded image, either from stb_image or mapped from the cache
+struct image {
+    unsigned char *data; // pixels, n bytes each, row by row
+    int w, h, n; // width, height, number of channels
+    unsigned int frames; // number of frames, each h rows below the last
+    unsigned int ox, oy; // where the image starts in the original
+    void *map; // cache file mapping, or NULL if data is from stb_image
+    size_t map_len; // length of the mapping
+};
+
+// decoded-image cache file layout: this header, then the pixels
+// The pixels are the crop of the image that the renderer reads, so a warm
+// run maps them and uses them in place.
+#define CACHE_MAGIC "ITSPIXEL"
+#define CACHE_VERSION 2
+struct cache_header {
+    char magic[8]; // CACHE_MAGIC
+    uint32_t version; // CACHE_VERSION
+    uint32_t w, h, n; // size and channels of the stored pixels
+    uint32_t frames; // number of frames stored
+    uint32_t animated; // 1 if every frame was decoded, 0 for the first only
+    uint32_t ox, oy; // crop offsets in the original image
+    uint64_t hash; // hash of the input file
+    uint64_t size; // size of the input file
+};
+
+// FNV-1a hash of a buffer
+uint64_t hash_bytes(const unsigned char *p, size_t n)
+{
+    uint64_t h = 0xcbf29ce484222325u;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ p[i]) * 0x100000001b3u;
+    return h;
+}
+
+// map a whole file for reading, so the decoder reads the page cache directly
+// instead of a copy of it
+// The file is hinted as read front to back, which is how images are decoded,
+// so the kernel reads ahead further and drops pages behind. Pipes and
+// anything else that cannot be mapped are read into memory instead.
+// mapped = set to whether the file was mapped, for unmap_file()
+// returns NULL if there is an error
+unsigned char *map_file(const char *filename, size_t *size, char *mapped)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED)
+    {
+        close(fd);
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        *size = st.st_size;
+        *mapped = 1;
+        return map;
+    }
+
+    // read to the end, doubling the buffer whenever it fills
+    size_t len = 0, cap = 1 << 16;
+    unsigned char *buf = malloc(cap);
+    ssize_t got = 0;
+    while (buf && (got = read(fd, buf + len, cap - len)) != 0)
+    {
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            break;
+        len += got;
+        if (len == cap)
+        {
+            unsigned char *p = realloc(buf, cap *= 2);
+            if (!p)
+                free(buf);
+            buf = p;
+        }
+    }
+    close(fd);
+    if (!buf || got < 0 || !len)
+    {
+        free(buf);
+        return NULL;
+    }
+    *size = len;
+    *mapped = 0;
+    return buf;
+}
+
+// release a file from map_file()
+void unmap_file(unsigned char *file, size_t size, char mapped)
+{
+    if (mapped)
+        munmap(file, size);
+    else
+        free(file);
+}
+
+// map a cache file if it holds the image for this key
+// returns non-zero if there is no usable entry
+int cache_map(struct image *im, const char *path, const struct cache_header *key)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct cache_header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 1;
+    const struct cache_header *hd = map;
+    if (memcmp(hd->magic, key->magic, sizeof(hd->magic))
+            || hd->version != key->version || hd->hash != key->hash
+            || hd->size != key->size || hd->ox != key->ox || hd->oy != key->oy
+            || hd->h != key->h || hd->animated != key->animated
+            || st.st_size != sizeof(*hd) + (uint64_t)hd->w * hd->h * hd->n * hd->frames)
+    {
+        munmap(map, st.st_size);
+        return 1;
+    }
+    im->data = (unsigned char *)map + sizeof(*hd);
+    im->w = hd->w;
+    im->h = hd->h;
+    im->n = hd->n;
+    im->frames = hd->frames;
+    im->ox = hd->ox;
+    im->oy = hd->oy;
+    im->map = map;
+    im->map_len = st.st_size;
+    return 0;
+}
+
+// store the crop of an image in the cache
+// The entry is written under a temporary name and renamed into place, so a
+// concurrent run never maps a half-written file.
+// returns non-zero if there is an error
+int cache_store(
+        const char *path, const struct cache_header *key,
+        const struct image *im)
+{
+    struct cache_header hd = *key;
+    hd.w = im->w - key->ox;
+    hd.n = im->n;
+    hd.frames = im->frames;
+    size_t tmp_len = strlen(path) + 32;
+    char *tmp = malloc(tmp_len);
+    if (!tmp)
+        return 1;
+    snprintf(tmp, tmp_len, "%s.%ld.tmp", path, (long)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    int err = !fp || fwrite(&hd, sizeof(hd), 1, fp) != 1;
+    for (uint32_t f = 0; !err && f < hd.frames; f++)
+    {
+        for (uint32_t y = 0; !err && y < hd.h; y++)
+        {
+            size_t row = (size_t)f * im->h + key->oy + y;
+            err = fwrite(im->data + (row * im->w + key->ox) * im->n, im->n, hd.w, fp) != hd.w;
+        }
+    }
+    if (fp && fclose(fp))
+        err = 1;
+    if (!err && rename(tmp, path))
+        err = 1;
+    if (err)
+        remove(tmp);
+    free(tmp);
+    return err;
+}
+
+// decode an image, going through the cache in c->cache_dir if there is one
+// rows = how many rows from c->oy the renderer reads, 0 for all of them
+// Every frame of an animated GIF is decoded unless c->frames is
+// FRAMES_FIRST. GIF frames are drawn over the previous ones, so they are
+// decoded one after the other.
+// returns non-zero if there is an error
+int image_load(
+        struct image *im, const char *filename, unsigned int rows,
+        const struct config *c)
 {
-    if (strcmp(in_filename, out_filename) == 0)
+    memset(im, 0, sizeof(*im));
+    const double t0 = now();
+    size_t size;
+    char mapped;
+    unsigned char *file = map_file(filename, &size, &mapped);
+    if (!file)
     {
-        if (v) fprintf(stderr, "input filename and output filename must be different\n");
+        fprintf(stderr, "could not load input file\n");
         return 1;
     }
-    if (!in_filename) 
+    int w, h, n;
+    if (!stbi_info_from_memory(file, size, &w, &h, &n))
     {
-        if (v) fprintf(stderr, "invalid input filename\n");
+        fprintf(stderr, "could not load input file\n");
+        unmap_file(file, size, mapped);
         return 1;
     }
-    if (!out_filename)
+    // the crop has to fit before it can be a cache key
+    if (w <= c->ox)
     {
-        if (v) fprintf(stderr, "invalid output filename\n");
+        fprintf(stderr, "start x (%d) is larger than the image width (%d)\n", c->ox, w);
+        unmap_file(file, size, mapped);
         return 1;
     }
-    if (!rate)
+    if (h <= c->oy)
     {
-        if (v) fprintf(stderr, "invalid rate\n");
+        fprintf(stderr, "start y (%d) is larger than the image height (%d)\n", c->oy, h);
+        unmap_file(file, size, mapped);
         return 1;
     }
-    if (!spp)
+    if (!rows || rows > h - c->oy)
+        rows = h - c->oy;
+
+    struct cache_header key = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .h = rows,
+        .animated = c->frames != FRAMES_FIRST,
+        .ox = c->ox,
+        .oy = c->oy,
+        .size = size,
+    };
+    char *path = NULL;
+    if (c->cache_dir)
+    {
+        key.hash = hash_bytes(file, size);
+        size_t path_len = strlen(c->cache_dir) + 64;
+        path = malloc(path_len);
+        if (path)
+            snprintf(path, path_len, "%s/%016llx-%u-%u-%u%s.px", c->cache_dir,
+                    (unsigned long long)key.hash, key.ox, key.oy, key.h,
+                    key.animated? "-all" : "");
+        if (path && !cache_map(im, path, &key))
+        {
+            if (c->v)
+                fprintf(stderr, "cache hit: %s\n", path);
+            free(path);
+            unmap_file(file, size, mapped);
+            return 0;
+        }
+    }
+
+    // gray images (with or without alpha) stay at their own channel count
+    // and only their first byte is read; anything else is converted to RGB
+    const int want = (n < 3)? 0 : 3;
+    im->frames = 1;
+    if (key.animated && size >= 4 && memcmp(file, "GIF8", 4) == 0)
+    {
+        int frames;
+        im->data = stbi_load_gif_from_memory(file, size, NULL, &im->w, &im->h,
+                &frames, &im->n, 3);
+        im->frames = frames;
+        im->n = 3;
+    }
+    else
+        im->data = stbi_load_from_memory(file, size, &im->w, &im->h, &im->n, want);
+    unmap_file(file, size, mapped);
+    if (!im->data)
     {
-        if (v) fprintf(stderr, "invalid samples per pixel\n");
+        fprintf(stderr, "could not load input file\n");
+        free(path);
         return 1;
     }
+    if (want)
+        im->n = want;
+    if (c->v)
+        fprintf(stderr, "decoded %zu bytes in %.1f ms\n", size, (now() - t0) * 1e3);
+    if (path)
+    {
+        // keep the crop for next time, and use the mapped copy from now on
+        // so cold and warm runs read the same pixels
+        struct image cached;
+        if (cache_store(path, &key, im)
+                || cache_map(&cached, path, &key))
+            fprintf(stderr, "warning: could not write cache file %s\n", path);
+        else
+        {
+            if (c->v)
+                fprintf(stderr, "cache: wrote %s\n", path);
+            stbi_image_free(im->data);
+            *im = cached;
+        }
+        free(path);
+    }
     return 0;
 }
 
-// in_filename = name of input image file
-// out_filename = name of output file to create
-// r = sample rate
-// tpp = time per pixel
-// ox = offset x
-// oy = offset y
-// v = verbose flag
-// returns non-zero if there is an error
-int process(
-        char *in_filename, char *out_filename, unsigned int rate,
-        unsigned int spp, unsigned int ox, unsigned int oy, char v)
+void image_free(struct image *im)
+{
+    if (im->map)
+        munmap(im->map, im->map_len);
+    else
+        stbi_image_free(im->data);
+}
+
+// frames read one after another from a stream of PPM or Y4M images
+struct frame_stream {
+    FILE *fp;
+    char y4m; // YUV4MPEG2 rather than PPM
+    int w, h, n; // size and channels of the current frame
+    size_t chroma; // bytes of chroma after each Y4M luma plane
+    unsigned char luma[256]; // Y4M luma to gray level
+    double fps; // frame rate, 0 if the stream does not say
+    unsigned char *data; // pixels of the current frame
+    size_t cap; // size of data
+};
+
+// read a number from a PPM header, skipping white space and comments
+static int ppm_number(FILE *fp, int *value)
 {
-    if (process_check(in_filename, out_filename, rate, spp, v))
+    int ch;
+    while ((ch = getc(fp)) == '#' || isspace(ch))
+    {
+        if (ch == '#')
+            while ((ch = getc(fp)) != '\n' && ch != EOF)
+                ;
+    }
+    if (!isdigit(ch))
         return 1;
+    *value = 0;
+    for (; isdigit(ch); ch = getc(fp))
+    {
+        if (*value > INT_MAX / 10)
+            return 1;
+        *value = *value * 10 + ch - '0';
+    }
+    // exactly one white space character ends the number
+    return !isspace(ch);
+}
 
-    const float tpp = (float)spp / rate; // time per pixel
-    if (v)
-        fprintf(stderr, "time per pixel: %fs\n", tpp);
+// make room for a frame of the current size
+static int stream_reserve(struct frame_stream *fs, size_t size)
+{
+    if (size <= fs->cap)
+        return 0;
+    unsigned char *p = realloc(fs->data, size);
+    if (!p)
+        return 1;
+    fs->data = p;
+    fs->cap = size;
+    return 0;
+}
 
-    // load image
-    // width, height, num. of channels
-    int w, h, n;
-    unsigned char *data = stbi_load(in_filename, &w, &h, &n, 3);
-    if (!data)
+// read the stream header of a Y4M stream
+static int y4m_header(struct frame_stream *fs)
+{
+    char line[256];
+    if (!fgets(line, sizeof(line), fs->fp) || strncmp(line, "YUV4MPEG2 ", 10))
+        return 1;
+    char colour[32] = "420";
+    int full = 0;
+    for (char *t = strtok(line + 10, " \n"); t; t = strtok(NULL, " \n"))
     {
-        fprintf(stderr, "could not load input file\n");
+        unsigned int num, den;
+        switch (t[0])
+        {
+            case 'W': fs->w = atoi(t + 1); break;
+            case 'H': fs->h = atoi(t + 1); break;
+            case 'F':
+                if (sscanf(t + 1, "%u:%u", &num, &den) == 2 && den)
+                    fs->fps = (double)num / den;
+                break;
+            case 'C': snprintf(colour, sizeof(colour), "%s", t + 1); break;
+            case 'X': full |= strcmp(t, "XCOLORRANGE=FULL") == 0; break;
+        }
+    }
+    if (fs->w <= 0 || fs->h <= 0)
         return 1;
+    const size_t cw = (fs->w + 1) / 2, ch = (fs->h + 1) / 2;
+    if (strcmp(colour, "420") == 0 || strcmp(colour, "420jpeg") == 0
+            || strcmp(colour, "420paldv") == 0 || strcmp(colour, "420mpeg2") == 0)
+        fs->chroma = 2 * cw * ch;
+    else if (strcmp(colour, "422") == 0)
+        fs->chroma = 2 * cw * fs->h;
+    else if (strcmp(colour, "444") == 0)
+        fs->chroma = 2 * (size_t)fs->w * fs->h;
+    else if (strcmp(colour, "444alpha") == 0)
+        fs->chroma = 3 * (size_t)fs->w * fs->h;
+    else if (strcmp(colour, "mono") == 0)
+        fs->chroma = 0;
+    else
+        return 1;
+    // black is 16 in the usual limited range
+    for (int y = 0; y < 256; y++)
+    {
+        int g = full? y : ((y - 16) * 255 + 109) / 219;
+        fs->luma[y] = (g < 0)? 0 : (g > 255)? 255 : g;
     }
+    fs->n = 1;
+    return 0;
+}
 
-    if (v)
-        fprintf(stderr, "input image size is %dx%d\n", w, h);
+// returns non-zero if the stream is neither PPM nor Y4M
+int stream_open(struct frame_stream *fs, FILE *fp)
+{
+    memset(fs, 0, sizeof(*fs));
+    fs->fp = fp;
+    int ch = getc(fp);
+    ungetc(ch, fp);
+    fs->y4m = ch == 'Y';
+    if (fs->y4m)
+        return y4m_header(fs);
+    return ch != 'P';
+}
+
+// read the next frame
+// returns 1 for a frame, 0 at the end of the stream, -1 if there is an error
+int stream_next(struct frame_stream *fs)
+{
+    FILE *fp = fs->fp;
+    int ch = getc(fp);
+    if (ch == EOF)
+        return 0;
+    if (fs->y4m)
+    {
+        // FRAME, optional parameters, then the planes
+        char tag[5];
+        tag[0] = ch;
+        if (fread(tag + 1, 1, 4, fp) != 4 || memcmp(tag, "FRAME", 5))
+            return -1;
+        while ((ch = getc(fp)) != '\n')
+            if (ch == EOF)
+                return -1;
+        size_t size = (size_t)fs->w * fs->h;
+        if (stream_reserve(fs, size) || fread(fs->data, 1, size, fp) != size)
+            return -1;
+        for (size_t i = 0; i < size; i++)
+            fs->data[i] = fs->luma[fs->data[i]];
+        for (size_t left = fs->chroma; left; )
+        {
+            unsigned char skip[4096];
+            size_t n = (left < sizeof(skip))? left : sizeof(skip);
+            if (fread(skip, 1, n, fp) != n)
+                return -1;
+            left -= n;
+        }
+        return 1;
+    }
+    // each PPM (P6) or PGM (P5) frame has its own header
+    int kind = getc(fp), max;
+    if (ch != 'P' || (kind != '5' && kind != '6')
+            || ppm_number(fp, &fs->w) || ppm_number(fp, &fs->h)
+            || ppm_number(fp, &max) || !fs->w || !fs->h || !max || max > 255)
+        return -1;
+    fs->n = (kind == '6')? 3 : 1;
+    size_t size = (size_t)fs->w * fs->h * fs->n;
+    if (stream_reserve(fs, size) || fread(fs->data, 1, size, fp) != size)
+        return -1;
+    if (max != 255)
+        for (size_t i = 0; i < size; i++)
+            fs->data[i] = (fs->data[i] > max)? 255 : fs->data[i] * 255 / max;
+    return 1;
+}
 
-    // check starting offsets
-    if (w <= ox)
+// render frames from stdin as they arrive
+// Every frame plays its columns from c->ox on, or with c->stream_column
+// only that one column. The stream cannot be scanned ahead for the peak
+// polyphony, so the gain is set by the polyphony limit instead.
+int render_stream(struct output *out, const struct config *c)
+{
+    const unsigned int max_notes = c->max_notes? c->max_notes : NUM_KEYS;
+    struct frame_stream fs;
+    if (stream_open(&fs, stdin))
     {
-        fprintf(stderr, "start x (%d) is larger than the image width (%d)\n", ox, w);
+        fprintf(stderr, "input stream is not PPM or YUV4MPEG2\n");
         return 1;
     }
-    if (h <= oy)
+    struct note_renderer r;
+    if (notes_init(&r, notes_gain(max_notes, c), c))
     {
-        fprintf(stderr, "start y (%d) is larger than the image height (%d)\n", oy, h);
+        notes_free(&r);
         return 1;
     }
+    // extract quietly, the verbose notes would repeat for every frame
+    struct config ec = *c;
+    ec.v = 0;
+
+    int err = 0, got;
+    unsigned long frames = 0, late = 0;
+    uint64_t columns = 0;
+    double busy = 0, worst = 0;
+    while ((got = stream_next(&fs)) > 0)
+    {
+        double t0 = now();
+        if (fs.w <= c->ox || fs.h <= c->oy)
+        {
+            fprintf(stderr, "frame %lu (%dx%d) is smaller than the start offsets\n",
+                    frames, fs.w, fs.h);
+            err = 1;
+            break;
+        }
+        struct score sc;
+        if (score_from_image(&sc, fs.data, fs.w, fs.h, fs.n, 1, &ec))
+        {
+            score_free(&sc);
+            err = 1;
+            break;
+        }
+        const uint32_t cols = c->stream_column? 1 : sc.columns;
+        for (uint32_t x = 0; x < cols; x++)
+            notes_column(&r, out, sc.events + sc.index[x], sc.index[x + 1] - sc.index[x]);
+        score_free(&sc);
+        // hand the audio of this frame on straight away
+        output_flush(out);
+
+        // keeping pace means rendering a frame takes less time than the
+        // audio it makes takes to play, which -p sets whatever the frame
+        // rate of the stream
+        const double t = now() - t0, length = (double)cols * c->spp / c->rate;
+        if (c->v && !frames)
+        {
+            fprintf(stderr, "stream: %dx%d %s frames, %.1f ms of audio each",
+                    fs.w, fs.h, fs.y4m? "Y4M" : "PPM", length * 1e3);
+            if (fs.fps)
+                fprintf(stderr, ", %.1f ms apart", 1e3 / fs.fps);
+            fprintf(stderr, "\n");
+        }
+        busy += t;
+        if (t / length > worst)
+            worst = t / length;
+        late += t > length;
+        columns += cols;
+        frames++;
+    }
+    if (got < 0)
+    {
+        fprintf(stderr, "bad frame %lu in the input stream\n", frames);
+        err = 1;
+    }
+    notes_free(&r);
+    free(fs.data);
 
-    if (v) fprintf(stderr, "output length will be %fs long\n", w * tpp);
+    const double audio = (double)columns * c->spp / c->rate;
+    if (c->v || late)
+        fprintf(stderr, "stream: %lu frames, %.2fs of audio rendered in %.2fs "
+                "(%.1fx real time, slowest frame %.0f%% of its length), %s\n",
+                frames, audio, busy, busy? audio / busy : 0, worst * 100,
+                late? "fell behind" : "kept pace");
+    if (late)
+        fprintf(stderr, "warning: %lu of %lu frames took longer to render than to play\n",
+                late, frames);
+    return err;
+}
 
-    // audio output file
-    FILE *out = fopen(out_filename, "w+");
-    if (!out)
+// golden-output checks run by --verify
+// Each optimized render path plays the same notes as generate_samples(), the
+// reference, and must stay within a signal-to-noise ratio of it. The
+// band-limited kernels are held to a band-limited reference instead (see
+// verify_reference()), and voices at or above half the rate, where their
+// corrections overlap, are silenced on that path. The
+// thresholds leave room for rounding and for what a path changes on purpose
+// (Q15 arithmetic, 16-bit samples); a kernel that changes the sound falls
+// short by tens of dB. SNRs rather than hashes, since the kernel
+// builds for each x86-64 level differ in the last bit.
+// A sample within VERIFY_EDGE cycles of a saw or square edge may land on
+// either side of the jump in any path (at 440 Hz every 1200th sample at
+// 48 kHz is on one), so those samples are left out.
+#define VERIFY_EDGE 1e-4
+enum {
+    VERIFY_NAIVE, // float kernels, as dispatched
+    VERIFY_BANDLIMITED, // band-limited float kernels
+    VERIFY_STEREO, // stereo kernels with every note centred
+    VERIFY_ENVELOPE, // --adsr 0,0,1,0, which fades new notes in over a block
+    VERIFY_FIXED, // fixed-point kernels
+    VERIFY_S16, // 16-bit samples written by the output stage
+    VERIFY_PATHS,
+};
+
+static const struct {
+    const char *name;
+    double min_snr; // dB
+} verify_paths[] = {
+    [VERIFY_NAIVE] = {"naive", 80},
+    [VERIFY_BANDLIMITED] = {"band-limited", 80},
+    [VERIFY_STEREO] = {"stereo", 80},
+    [VERIFY_ENVELOPE] = {"envelope", 80},
+    [VERIFY_FIXED] = {"fixed-point", 45},
+    [VERIFY_S16] = {"s16 output", 45},
+};
+
+// build a score that plays every key with every waveform, with chords of
+// about 20 notes that change every few columns, so that notes start, hold
+// and stop
+// returns non-zero if there is an error
+int score_sweep(struct score *sc, uint32_t columns)
+{
+    memset(sc, 0, sizeof(*sc));
+    sc->buf = malloc((columns + 1) * sizeof(uint32_t)
+            + (size_t)columns * NUM_KEYS * sizeof(struct score_event));
+    if (!sc->buf)
     {
-        perror("fopen");
-        stbi_image_free(data);
+        fprintf(stderr, "out of memory\n");
         return 1;
     }
+    uint32_t *index = sc->buf;
+    struct score_event *e = (struct score_event *)(index + columns + 1);
+    uint32_t n = 0;
+    for (uint32_t x = 0; x < columns; x++)
+    {
+        index[x] = n;
+        for (unsigned int k = 1; k <= NUM_KEYS; k++)
+        {
+            if ((k * 5 + x / 4) % 11 >= 3)
+                continue;
+            e[n].key = k;
+            e[n].wave = (k + x / 8) % (WAVE_SQUARE + 1);
+            e[n].level = 64 + k * 37 % 192;
+            e[n].pan = 0;
+            n++;
+        }
+    }
+    index[columns] = n;
+    sc->columns = columns;
+    sc->index = index;
+    sc->events = e;
+    return 0;
+}
+
+// second antiderivative of a naive wave at phase x in cycles, for the
+// band-limited reference; sines are never smoothed
+static double verify_integral2(int wave, double x)
+{
+    const double n = floor(x), u = x - n;
+    switch (wave)
+    {
+        case WAVE_SAW:
+            return -n / 12 + u * u * u / 6 - u * u / 4;
+        case WAVE_TRIANGLE:
+            return (u < 0.5)? u * u / 4 - u * u * u / 3 : u * u * u / 3 - 0.75 * u * u + u / 2 - 1.0 / 12;
+        case WAVE_SQUARE:
+            return n / 4 + ((u < 0.5)? u * u / 2 : u - u * u / 2 - 0.25);
+    }
+    return 0;
+}
 
-    float t = 0; // time
-    // process each pixel
-    const int num_keys = 88;
-    const int max_notes = 12; // maximum notes to play at once (inclusive)
-    const int end_y = (h - oy < num_keys)? h : (oy + num_keys);
-    for (int x = ox; x < w; x++)
+// add the reference rendering of a voice to o, to o_env with the first
+// <ramp> samples faded in like the envelope path does, and to o_bl
+// band-limited, and mark the samples next to an edge in edge
+// The band-limited kernels' two-sample corrections are what the naive wave
+// becomes when smoothed by a triangle one sample wide either side, which the
+// band-limited reference works out directly, as a second difference of the
+// wave's second antiderivative. That only holds for voices below half the
+// rate, which are left out of it.
+// generate_samples() keeps time in a float, so it is called a block at a
+// time from within one period of the wave, which keeps its phase about as
+// exact as the kernels keep theirs. The band-limited reference takes each
+// sample's phase from the absolute sample index in double precision.
+// s0 = absolute sample index of o[0]
+// tmp = room for MIX_BLOCK samples
+static void verify_reference(
+        float *o, float *o_env, float *o_bl, unsigned char *edge, float *tmp,
+        const struct voice *v, unsigned int ramp, uint64_t s0, unsigned int r, unsigned int s)
+{
+    const double dt = v->inc;
+    const float f = key_to_frequency(v->key);
+    const double cycles = wave_cycles(v->wave, f);
+    // edges per cycle: saws jump once, squares twice
+    const int edges = (v->wave == WAVE_SAW)? 1 : (v->wave == WAVE_SQUARE)? 2 : 0;
+    for (unsigned int i = 0; i < s; i += MIX_BLOCK)
     {
-        float *col_buffer = calloc(spp, sizeof(float));
-        int notes = 0;
-        for (int y = oy; y < end_y; y++)
+        unsigned int len = (s - i < MIX_BLOCK)? s - i : MIX_BLOCK;
+        generate_samples(tmp, v->wave, fmod((double)(s0 + i) / r, 1 / cycles), f, v->amp, r, len);
+        for (unsigned int j = 0; j < len; j++)
         {
-            if (notes > max_notes)
+            o[i + j] += tmp[j];
+            o_env[i + j] += (i + j < ramp)? tmp[j] * (i + j) / ramp : tmp[j];
+            if (v->wave == WAVE_SINE && dt < 0.5)
+                o_bl[i + j] += tmp[j];
+            else if (dt < 0.5)
             {
-                fprintf(
-                        stderr,
-                        "note: maximum number of notes (%d) placed at one time at x = %d\n",
-                        max_notes, x);
-                break;
+                double t = (double)(s0 + i + j) * cycles / r;
+                t -= floor(t);
+                o_bl[i + j] += v->amp * (verify_integral2(v->wave, t + dt)
+                        - 2 * verify_integral2(v->wave, t) + verify_integral2(v->wave, t - dt)) / (dt * dt);
             }
-            int i = (y * w + x) * n;
-            char r = data[i + 0];
-            char g = data[i + 1];
-            char b = data[i + 2];
-            if (!r && !g && !b)
-            {
-                // silence
+            if (!edges)
                 continue;
-            }
-            // add a note
-            notes++;
-            int key = num_keys - (y - oy);
-            float f = key_to_frequency(key);
-            //printf("f: %f\n", f);
-            float a = color_to_amplitude(r, g, b) / max_notes;
-            int w = color_to_wave(r, g, b);
-            //printf("w:%d\n",w);
-            float *place_buffer = malloc(spp * sizeof(float));
-            generate_samples(place_buffer, w, t, f, a, rate, spp);
-            for (int i = 0; i < spp; i++)
-            {
-                col_buffer[i] += place_buffer[i];
-            }
-            free(place_buffer);
+            double p = (double)(s0 + i + j) * cycles * edges / r;
+            p -= floor(p);
+            edge[i + j] |= p < VERIFY_EDGE * edges || p > 1 - VERIFY_EDGE * edges;
         }
-        // no notes were added for this x/time
-        if (!notes)
+    }
+}
+
+// add the energy of ref to *sig and that of x * scale - ref to *err, but for
+// the samples marked in edge
+static void verify_add(
+        double *sig, double *err, const float *ref, const float *x, float scale,
+        const unsigned char *edge, unsigned int s)
+{
+    for (unsigned int i = 0; i < s; i++)
+    {
+        if (edge[i])
+            continue;
+        const double d = x[i] * scale - ref[i];
+        *sig += (double)ref[i] * ref[i];
+        *err += d * d;
+    }
+}
+
+// render the notes of a score to 16-bit samples in a new file in $TMPDIR (or
+// /tmp), the way a plain "-f s16" render of them would, and open it for
+// reading
+// returns NULL if there is an error
+static FILE *verify_render_s16(const struct score *sc, const struct config *c)
+{
+    struct config vc = *c;
+    vc.format = FORMAT_S16;
+    vc.container = CONTAINER_RAW;
+    vc.pan = PAN_NONE;
+    vc.limit = 0;
+    vc.normalize = NORMALIZE_NONE;
+    vc.envelope = 0;
+    vc.bandlimit = 0;
+    vc.oversample = 1;
+    vc.preview = 0;
+    vc.fixed = 0;
+    vc.direct = 0;
+    vc.io_uring = 0;
+    vc.v = 0;
+
+    const char *dir = getenv("TMPDIR");
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s/img_to_sound-verify-XXXXXX", (dir && *dir)? dir : "/tmp");
+    int fd = mkstemp(name);
+    if (fd < 0)
+    {
+        fprintf(stderr, "could not create a file to verify the output stage in\n");
+        return NULL;
+    }
+    close(fd);
+    struct output out;
+    int err = output_open(&out, name, &vc, vc.spp, (uint64_t)sc->columns * vc.spp);
+    if (!err)
+        err = render_notes(&out, sc, &vc);
+    if (output_close(&out))
+        err = 1;
+    FILE *rd = err? NULL : fopen(name, "rb");
+    unlink(name);
+    return rd;
+}
+
+// render the notes of a score through every path in verify_paths and print
+// how closely each follows the reference
+// name = what the score is, for the report
+// returns non-zero if a path falls short of its threshold or on error
+int verify(FILE *fp, const char *name, const struct score *sc, const struct config *c)
+{
+    const unsigned int spp = c->spp, rate = c->rate;
+    const unsigned int max_notes = c->max_notes? c->max_notes : NUM_KEYS;
+    unsigned int silent;
+    const float gain = 1.0f / peak_polyphony(sc, c, &silent);
+    struct envelope env;
+    envelope_init(&env, 0, 0, 1, 0, rate);
+
+    struct voice_pool *pools = calloc(VERIFY_PATHS, sizeof(*pools));
+    struct voice *notes = malloc(MAX_VOICES * sizeof(*notes));
+    float *ref = malloc(spp * sizeof(float)), *ref_env = malloc(spp * sizeof(float));
+    float *ref_bl = malloc(spp * sizeof(float));
+    float *x = malloc(spp * sizeof(float)), *x2 = malloc(spp * sizeof(float));
+    int32_t *q = malloc(spp * sizeof(*q));
+    int16_t *s16 = malloc(spp * sizeof(*s16));
+    unsigned char *edge = malloc(spp);
+    float tmp[MIX_BLOCK];
+    int err = !pools || !notes || !ref || !ref_env || !ref_bl || !x || !x2 || !q || !s16 || !edge;
+    if (err)
+        fprintf(stderr, "out of memory\n");
+    FILE *rd = err? NULL : verify_render_s16(sc, c);
+    err |= !rd;
+    double sig[VERIFY_PATHS] = {0}, noise[VERIFY_PATHS] = {0};
+    uint64_t skipped = 0;
+    float gl, gr;
+    pan_gains(0, &gl, &gr);
+    uint64_t s0 = 0;
+    for (uint32_t col = 0; col < sc->columns && !err; col++, s0 += spp)
+    {
+        const struct score_event *e = sc->events + sc->index[col];
+        const unsigned int count = sc->index[col + 1] - sc->index[col];
+        // every path keeps its own voices, as each advances their phases
+        for (int p = 0; p < VERIFY_PATHS; p++)
         {
-            for (int i = 0; i < spp; i++)
+            for (unsigned int i = 0; i < count; i++)
             {
-                col_buffer[i] = 0;
+                notes[i] = (struct voice){0};
+                notes[i].key = e[i].key;
+                notes[i].wave = e[i].wave;
+                notes[i].amp = e[i].level / 255.0f * gain;
             }
+            pool_update(&pools[p], notes, count, max_notes, c->priority, s0, rate,
+                    (p == VERIFY_ENVELOPE)? &env : NULL);
+        }
+
+        // the reference, from the voices before the envelope starts them
+        const struct voice_pool *pe = &pools[VERIFY_ENVELOPE];
+        const unsigned int ramp = (spp < MIX_BLOCK)? spp : MIX_BLOCK;
+        memset(ref, 0, spp * sizeof(float));
+        memset(ref_env, 0, spp * sizeof(float));
+        memset(ref_bl, 0, spp * sizeof(float));
+        memset(edge, 0, spp);
+        for (unsigned int v = 0; v < pe->count; v++)
+            verify_reference(ref, ref_env, ref_bl, edge, tmp, &pe->voices[v],
+                    (pe->voices[v].stage == ENV_ATTACK)? ramp : 0, s0, rate, spp);
+        for (unsigned int i = 0; i < spp; i++)
+            skipped += edge[i];
+
+        memset(x, 0, spp * sizeof(float));
+        mix_voices(x, pools[VERIFY_NAIVE].voices, pools[VERIFY_NAIVE].count, spp,
+                naive_kernels, NULL);
+        verify_add(&sig[VERIFY_NAIVE], &noise[VERIFY_NAIVE], ref, x, 1, edge, spp);
+
+        struct voice_pool *pb = &pools[VERIFY_BANDLIMITED];
+        for (unsigned int v = 0; v < pb->count; v++)
+            if (pb->voices[v].inc >= 0.5)
+                pb->voices[v].amp = 0;
+        memset(x, 0, spp * sizeof(float));
+        mix_voices(x, pools[VERIFY_BANDLIMITED].voices, pools[VERIFY_BANDLIMITED].count, spp,
+                bandlimited_kernels, NULL);
+        verify_add(&sig[VERIFY_BANDLIMITED], &noise[VERIFY_BANDLIMITED], ref_bl, x, 1, edge, spp);
+
+        memset(x, 0, spp * sizeof(float));
+        memset(x2, 0, spp * sizeof(float));
+        mix_voices_stereo(x, x2, pools[VERIFY_STEREO].voices, pools[VERIFY_STEREO].count, spp,
+                naive_stereo_kernels, NULL);
+        verify_add(&sig[VERIFY_STEREO], &noise[VERIFY_STEREO], ref, x, 1 / gl, edge, spp);
+        verify_add(&sig[VERIFY_STEREO], &noise[VERIFY_STEREO], ref, x2, 1 / gr, edge, spp);
+
+        memset(x, 0, spp * sizeof(float));
+        mix_voices(x, pools[VERIFY_ENVELOPE].voices, pools[VERIFY_ENVELOPE].count, spp,
+                naive_kernels, &env);
+        verify_add(&sig[VERIFY_ENVELOPE], &noise[VERIFY_ENVELOPE], ref_env, x, 1, edge, spp);
+
+        memset(q, 0, spp * sizeof(*q));
+        mix_voices_fixed(q, pools[VERIFY_FIXED].voices, pools[VERIFY_FIXED].count, spp);
+        for (unsigned int i = 0; i < spp; i++)
+            x[i] = q[i];
+        verify_add(&sig[VERIFY_FIXED], &noise[VERIFY_FIXED], ref, x, 1.0f / 32768, edge, spp);
+
+        if (fread(s16, sizeof(*s16), spp, rd) != spp)
+        {
+            fprintf(stderr, "the output stage wrote too few samples\n");
+            err = 1;
+            break;
+        }
+        for (unsigned int i = 0; i < spp; i++)
+            x[i] = to_le16(s16[i]);
+        verify_add(&sig[VERIFY_S16], &noise[VERIFY_S16], ref, x, 1.0f / INT16_MAX, edge, spp);
+    }
+
+    if (!err)
+    {
+        fprintf(fp, "\n%s: %u columns, %u notes, %u Hz, %.2f%% of samples on an edge\n",
+                name, sc->columns, sc->index[sc->columns] - sc->index[0], rate,
+                s0? 100.0 * skipped / s0 : 0);
+        fprintf(fp, "%-14s %10s %10s\n", "path", "SNR (dB)", "minimum");
+        for (int p = 0; p < VERIFY_PATHS; p++)
+        {
+            // a silent score matches on every path
+            const double snr = noise[p]? 10 * log10(sig[p] / noise[p]) : INFINITY;
+            const int ok = snr >= verify_paths[p].min_snr;
+            fprintf(fp, "%-14s %10.1f %10.1f %s\n", verify_paths[p].name, snr,
+                    verify_paths[p].min_snr, ok? "ok" : "FAIL");
+            err |= !ok;
+        }
+    }
+    free(pools);
+    free(notes);
+    free(ref);
+    free(ref_env);
+    free(ref_bl);
+    free(x);
+    free(x2);
+    free(q);
+    free(s16);
+    free(edge);
+    if (rd)
+        fclose(rd);
+    return err;
+}
+
+// in_filename = name of input image file
+// out_filename = name of output file to create
+// c = rendering settings
+// returns non-zero if there is an error
+int process(char *in_filename, char *out_filename, const struct config *c)
+{
+    if (process_check(in_filename, out_filename, c))
+        return 1;
+
+    const double t0 = now(); // for the preview report, decoding included
+    const char v = c->v;
+    const float tpp = (float)c->spp / c->rate; // time per pixel
+    if (v)
+        fprintf(stderr, "time per pixel: %fs\n", tpp);
+
+    if (strcmp(in_filename, "-") == 0)
+    {
+        // frames on stdin, rendered as they come
+        struct config rc = *c;
+        rc.rate *= c->oversample;
+        rc.spp *= c->oversample;
+        struct output out;
+        int err = output_open(&out, out_filename, c, rc.spp, 0);
+        if (!err)
+            err = render_stream(&out, &rc);
+        if (output_close(&out))
+            err = 1;
+        return err;
+    }
+
+    // a score file plays as it is, anything else is an image
+    struct score sc = {0};
+    struct image im = {0};
+    int w = 0, h = 0, n = 0;
+    struct config ic = *c; // offsets into the loaded image
+    if (score_detect(in_filename))
+    {
+        if (c->mode != MODE_NOTES || c->oy)
+        {
+            fprintf(stderr, "scores can only be rendered as notes, without a y offset\n");
+            return 1;
         }
-        // write current range to file
-        int8_t *int_buffer = malloc(spp * sizeof(*int_buffer));
-        for (int i = 0; i < spp; i++)
+        if (score_map(&sc, in_filename))
         {
-            int_buffer[i] = (int8_t)(col_buffer[i] * INT8_MAX);
+            score_free(&sc);
+            return 1;
         }
-        fwrite(int_buffer, sizeof(*int_buffer), spp, out);
-        free(int_buffer);
-        free(col_buffer);
-        t += tpp;
+        if (c->ox >= sc.columns)
+        {
+            fprintf(stderr, "start x (%d) is larger than the score length (%u)\n", c->ox, sc.columns);
+            score_free(&sc);
+            return 1;
+        }
+        // skip the first columns in place
+        sc.index += c->ox;
+        sc.columns -= c->ox;
+        if (v)
+            fprintf(stderr, "input score has %u columns, %u notes\n",
+                    sc.columns, sc.index[sc.columns] - sc.index[0]);
+    }
+    else
+    {
+        // load image
+        // The notes renderer only reads the 88 rows from oy, the spectrogram
+        // renderer reads every row.
+        if (image_load(&im, in_filename, (c->mode == MODE_NOTES)? NUM_KEYS : 0, c))
+            return 1;
+        w = im.w;
+        h = im.h;
+        n = im.n;
+        if (v)
+            fprintf(stderr, "input image size is %dx%d, %s, %u frame%s%s\n", w, h,
+                    (n < 3)? "grayscale" : "colour", im.frames,
+                    (im.frames > 1)? "s" : "", im.map? ", cropped" : "");
+        // a cached image has the offsets cropped off already
+        ic.ox -= im.ox;
+        ic.oy -= im.oy;
+        if (c->mode == MODE_NOTES)
+        {
+            int err = score_from_image(&sc, im.data, w, h, n, im.frames, &ic);
+            image_free(&im);
+            im.data = NULL;
+            if (err)
+                return 1;
+        }
+    }
+
+    if (c->to_score)
+    {
+        int err = score_write(&sc, out_filename);
+        if (v && !err)
+            fprintf(stderr, "wrote a score of %u columns, %u notes\n",
+                    sc.columns, sc.index[sc.columns] - sc.index[0]);
+        score_free(&sc);
+        return err;
+    }
+
+    if (c->verify)
+    {
+        int err = verify(stdout, in_filename, &sc, &ic);
+        score_free(&sc);
+        return err;
+    }
+
+    const unsigned int columns = (c->mode == MODE_NOTES)? sc.columns : w - ic.ox;
+    if (v) fprintf(stderr, "output length will be %fs long\n", columns * tpp);
+
+    // notes are rendered at the oversampled rate
+    struct config rc = ic;
+    rc.rate *= c->oversample;
+    rc.spp *= c->oversample;
+
+    // audio output file
+    struct output out;
+    int err = output_open(&out, out_filename, c, rc.spp, (uint64_t)columns * c->spp);
+    if (!err)
+    {
+        if (c->mode == MODE_SPECTROGRAM)
+            err = render_spectrogram(&out, im.data, w, h, n, &ic);
+        else
+            err = render_notes(&out, &sc, &rc);
     }
 
     // cleanup
-    fclose(out);
-    stbi_image_free(data);
-    return 0;
+    if (output_close(&out))
+        err = 1;
+    if (c->preview && v && !err)
+    {
+        const double t = now() - t0, audio = columns * tpp;
+        fprintf(stderr, "preview: %.2fs of audio decoded and rendered at %u Hz in %.3fs "
+                "(%.0fx real time), %ux fewer samples than a full render\n",
+                audio, c->rate, t, t? audio / t : 0, c->preview);
+    }
+    if (im.data)
+        image_free(&im);
+    score_free(&sc);
+    return err;
 }
 
 void print_usage(FILE *fp, char *program)
@@ -299,13 +5181,94 @@ void print_usage(FILE *fp, char *program)
         "Options:\n"
         "    -h         show the help mesage\n"
         "    -v         print out information (verbose)\n"
-        "    -o file    output audio to file\n"
+        "    -o file    output audio to file, - for stdout\n"
         "    -r rate    set the sample rate in Hertz (default is %d)\n"
         "    -p ppm     set the pixels per minute, also know as tempo, (default is %d)\n"
         "    -x offset  ignore the first <offset> X columns of the image (default is 0)\n"
         "    -y offset  ignore the first <offset> Y rows of the image (default is 0)\n"
-        "NOTE: All options that take arguments take integer arguments.\n",
-        program, DEFAULT_SAMPLE_RATE, DEFAULT_PX_PER_MIN);
+        "    -n, --polyphony count\n"
+        "               play at most <count> notes at once, 0 for no limit (default is 0)\n"
+        "    -P, --priority amp|low|high\n"
+        "               which notes to keep when a column has more than the\n"
+        "               polyphony limit: the loudest, the lowest or the highest\n"
+        "               (default is amp)\n"
+        "    -S, --spectrogram\n"
+        "               treat each column as a magnitude spectrum over the full\n"
+        "               image height instead of as notes on 88 piano keys\n"
+        "    -N, --fft-size size\n"
+        "               spectrogram FFT size, a power of 2 (default is %d)\n"
+        "    -H, --hop samples\n"
+        "               spectrogram hop size (default is a quarter of the FFT size)\n"
+        "    -b, --bandlimit\n"
+        "               use band-limited saw, square and triangle waves, which do\n"
+        "               not alias at high pitches\n"
+        "    --oversample factor\n"
+        "               render notes at <factor> times the sample rate and\n"
+        "               decimate to the sample rate (default is 1)\n"
+        "    -f, --format s8|s16|u8\n"
+        "               output samples as signed 8-bit, signed 16-bit\n"
+        "               little-endian or unsigned 8-bit (default is s8, which\n"
+        "               is written as u8 in a WAV file)\n"
+        "    --container raw|wav|flac\n"
+        "               write bare samples, a WAV file (RF64 past 4 GiB) or\n"
+        "               a FLAC file, compressed on all CPU cores (default is\n"
+        "               wav or flac if file-out ends in .wav or .flac, else raw)\n"
+        "    --pan pitch|colour\n"
+        "               render in stereo, with low notes on the left and high\n"
+        "               notes on the right, or with blue notes on the left and\n"
+        "               green notes on the right\n"
+        "    --adsr attack,decay,sustain,release\n"
+        "               shape each note with an envelope: rise over <attack>\n"
+        "               ms, fall over <decay> ms to the <sustain> level (0 to\n"
+        "               1) while held, then fade out over <release> ms\n"
+        "               (numbers may be fractional)\n"
+        "    --limit    set the volume for a typical column rather than the\n"
+        "               fullest one, and hold peaks under full scale with a\n"
+        "               5 ms look-ahead limiter\n"
+        "    --normalize peak|rms\n"
+        "               set the volume from the notes before rendering, so\n"
+        "               the loudest column just fits or the average level is\n"
+        "               -20 dBFS (which can only go past the loudest column\n"
+        "               with --limit)\n"
+        "    --preview  render a quick draft of the notes at a sixteenth of the\n"
+        "               rate, with plain oscillators and no oversampling, and\n"
+        "               with the highest notes an octave or more lower\n"
+        "    -w, --wave sine|saw|triangle|square\n"
+        "               waveform for grayscale images, which have no colour to\n"
+        "               choose one by (default is saw)\n"
+        "    --fixed    synthesize with integer arithmetic only\n"
+        "    --cache dir\n"
+        "               keep decoded images in <dir> and reuse them when the same\n"
+        "               file is rendered again with the same offsets\n"
+        "    --frames first|concat|layer\n"
+        "               play only the first frame of an animated GIF, all\n"
+        "               frames one after another, or all frames at once\n"
+        "               (default is first)\n"
+        "    --stream-column\n"
+        "               when file-in is - (a stream of PPM, PGM or YUV4MPEG2\n"
+        "               frames on stdin), play only the first column of each\n"
+        "               frame instead of all of them\n"
+        "    --to-score write the notes of the image to file-out as a score, which\n"
+        "               can be given as file-in instead of an image\n"
+        "    --block-size bytes\n"
+        "               write the output in blocks of this size, a multiple of\n"
+        "               %d, from a separate thread (default is %d)\n"
+        "    --direct   write the output file with direct I/O, bypassing the\n"
+        "               page cache, where the file system supports it\n"
+        "    --io-uring submit output writes through io_uring instead of a\n"
+        "               thread, where the kernel allows it\n"
+        "    --bench    time the synthesis kernels and the ways of writing the\n"
+        "               output (in the current directory), and exit\n"
+        "    --print-dispatch\n"
+        "               show which build of the synthesis kernels (for which\n"
+        "               x86-64 level) this CPU runs, and exit\n"
+        "    --verify   render file-in and any files after it (example.png if\n"
+        "               none are given), then every key with every waveform,\n"
+        "               through each render path, compare them with the\n"
+        "               reference renderer and exit non-zero if one differs\n"
+        "NOTE: Unless noted, options that take arguments take integer arguments.\n",
+        program, DEFAULT_SAMPLE_RATE, DEFAULT_PX_PER_MIN, DEFAULT_FFT_SIZE,
+        DIRECT_ALIGN, DEFAULT_BLOCK_SIZE);
 }
 
 // Calculate samples per pixel
@@ -319,6 +5282,28 @@ int calc_spp(unsigned int sr, unsigned int ppm)
     return sr / pps;
 }
 
+// long options without a short form
+enum {
+    OPT_BENCH = 256,
+    OPT_OVERSAMPLE,
+    OPT_FIXED,
+    OPT_CACHE,
+    OPT_TO_SCORE,
+    OPT_FRAMES,
+    OPT_STREAM_COLUMN,
+    OPT_BLOCK_SIZE,
+    OPT_DIRECT,
+    OPT_IO_URING,
+    OPT_CONTAINER,
+    OPT_PAN,
+    OPT_ADSR,
+    OPT_LIMIT,
+    OPT_NORMALIZE,
+    OPT_PREVIEW,
+    OPT_PRINT_DISPATCH,
+    OPT_VERIFY,
+};
+
 int main(int argc, char **argv)
 {
     char *in_filename = NULL;
@@ -328,10 +5313,53 @@ int main(int argc, char **argv)
     unsigned int y = 0;
     unsigned int sr = DEFAULT_SAMPLE_RATE; // default sample rate
     unsigned int ppm = DEFAULT_PX_PER_MIN;  // default pixels per minute
+    int container = -1; // CONTAINER_*, or -1 to go by the file name
+    struct config c = {
+        .mode = MODE_NOTES,
+        .priority = PRIORITY_AMP,
+        .oversample = 1,
+        .format = FORMAT_S8,
+        .wave = WAVE_SAW,
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .fft_size = DEFAULT_FFT_SIZE,
+        .hop = 0,
+    };
     // parse options
+    static const struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"polyphony", required_argument, NULL, 'n'},
+        {"priority", required_argument, NULL, 'P'},
+        {"bandlimit", no_argument, NULL, 'b'},
+        {"oversample", required_argument, NULL, OPT_OVERSAMPLE},
+        {"format", required_argument, NULL, 'f'},
+        {"container", required_argument, NULL, OPT_CONTAINER},
+        {"pan", required_argument, NULL, OPT_PAN},
+        {"adsr", required_argument, NULL, OPT_ADSR},
+        {"limit", no_argument, NULL, OPT_LIMIT},
+        {"normalize", required_argument, NULL, OPT_NORMALIZE},
+        {"preview", no_argument, NULL, OPT_PREVIEW},
+        {"wave", required_argument, NULL, 'w'},
+        {"fixed", no_argument, NULL, OPT_FIXED},
+        {"cache", required_argument, NULL, OPT_CACHE},
+        {"to-score", no_argument, NULL, OPT_TO_SCORE},
+        {"frames", required_argument, NULL, OPT_FRAMES},
+        {"stream-column", no_argument, NULL, OPT_STREAM_COLUMN},
+        {"block-size", required_argument, NULL, OPT_BLOCK_SIZE},
+        {"direct", no_argument, NULL, OPT_DIRECT},
+        {"io-uring", no_argument, NULL, OPT_IO_URING},
+        {"bench", no_argument, NULL, OPT_BENCH},
+        {"print-dispatch", no_argument, NULL, OPT_PRINT_DISPATCH},
+        {"verify", no_argument, NULL, OPT_VERIFY},
+        {"spectrogram", no_argument, NULL, 'S'},
+        {"fft-size", required_argument, NULL, 'N'},
+        {"hop", required_argument, NULL, 'H'},
+        {0},
+    };
     int opt;
     char *prog = (argc && argv)? argv[0] : NULL;
-    while ((opt = getopt(argc, argv, "hvr:p:x:y:o:")) != -1)
+    sine_table_init();
+    while ((opt = getopt_long(argc, argv, "hvr:p:x:y:o:n:P:bSN:H:f:w:", long_options, NULL)) != -1)
     {
         switch (opt)
         {
@@ -385,24 +5413,294 @@ int main(int argc, char **argv)
                 // output filename
                 out_filename = optarg;
                 break;
+            case 'n':
+                // polyphony limit
+                if (atoi(optarg) < 0)
+                {
+                    fprintf(stderr, "%s: error: -n argument must not be negative\n", prog);
+                    return 1;
+                }
+                c.max_notes = atoi(optarg);
+                break;
+            case 'P':
+                // voice priority
+                if (strcmp(optarg, "amp") == 0)
+                    c.priority = PRIORITY_AMP;
+                else if (strcmp(optarg, "low") == 0)
+                    c.priority = PRIORITY_LOW;
+                else if (strcmp(optarg, "high") == 0)
+                    c.priority = PRIORITY_HIGH;
+                else
+                {
+                    fprintf(stderr, "%s: error: unknown -P priority '%s'\n", prog, optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                // band-limited oscillators
+                c.bandlimit = 1;
+                break;
+            case OPT_OVERSAMPLE:
+                // oversampling factor
+                c.oversample = atoi(optarg);
+                if (c.oversample < 1 || c.oversample > 64)
+                {
+                    fprintf(stderr, "%s: error: --oversample argument must be between 1 and 64\n", prog);
+                    return 1;
+                }
+                break;
+            case 'f':
+                // sample format
+                if (strcmp(optarg, "s8") == 0)
+                    c.format = FORMAT_S8;
+                else if (strcmp(optarg, "s16") == 0)
+                    c.format = FORMAT_S16;
+                else if (strcmp(optarg, "u8") == 0)
+                    c.format = FORMAT_U8;
+                else
+                {
+                    fprintf(stderr, "%s: error: unknown -f format '%s'\n", prog, optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                // waveform for grayscale images
+                if (strcmp(optarg, "sine") == 0)
+                    c.wave = WAVE_SINE;
+                else if (strcmp(optarg, "saw") == 0)
+                    c.wave = WAVE_SAW;
+                else if (strcmp(optarg, "triangle") == 0)
+                    c.wave = WAVE_TRIANGLE;
+                else if (strcmp(optarg, "square") == 0)
+                    c.wave = WAVE_SQUARE;
+                else
+                {
+                    fprintf(stderr, "%s: error: unknown -w waveform '%s'\n", prog, optarg);
+                    return 1;
+                }
+                break;
+            case OPT_FIXED:
+                // fixed-point synthesis
+                c.fixed = 1;
+                break;
+            case OPT_CACHE:
+                // decoded image cache directory
+                c.cache_dir = optarg;
+                break;
+            case OPT_TO_SCORE:
+                // convert to a score file
+                c.to_score = 1;
+                break;
+            case OPT_FRAMES:
+                // animated images
+                if (strcmp(optarg, "first") == 0)
+                    c.frames = FRAMES_FIRST;
+                else if (strcmp(optarg, "concat") == 0)
+                    c.frames = FRAMES_CONCAT;
+                else if (strcmp(optarg, "layer") == 0)
+                    c.frames = FRAMES_LAYER;
+                else
+                {
+                    fprintf(stderr, "%s: error: unknown --frames mode '%s'\n", prog, optarg);
+                    return 1;
+                }
+                break;
+            case OPT_STREAM_COLUMN:
+                // one column per streamed frame
+                c.stream_column = 1;
+                break;
+            case OPT_BLOCK_SIZE:
+                // output block size
+                c.block_size = atol(optarg);
+                if (!c.block_size || c.block_size % DIRECT_ALIGN)
+                {
+                    fprintf(stderr, "%s: error: --block-size argument must be a multiple of %d\n",
+                            prog, DIRECT_ALIGN);
+                    return 1;
+                }
+                break;
+            case OPT_DIRECT:
+                // direct I/O
+                c.direct = 1;
+                break;
+            case OPT_IO_URING:
+                // io_uring writes
+                c.io_uring = 1;
+                break;
+            case OPT_CONTAINER:
+                // output file type
+                if (strcmp(optarg, "raw") == 0)
+                    container = CONTAINER_RAW;
+                else if (strcmp(optarg, "wav") == 0)
+                    container = CONTAINER_WAV;
+                else if (strcmp(optarg, "flac") == 0)
+                    container = CONTAINER_FLAC;
+                else
+                {
+                    fprintf(stderr, "%s: error: unknown --container '%s'\n", prog, optarg);
+                    return 1;
+                }
+                break;
+            case OPT_PAN:
+                // stereo placement
+                if (strcmp(optarg, "pitch") == 0)
+                    c.pan = PAN_PITCH;
+                else if (strcmp(optarg, "colour") == 0 || strcmp(optarg, "color") == 0)
+                    c.pan = PAN_COLOUR;
+                else
+                {
+                    fprintf(stderr, "%s: error: unknown --pan '%s'\n", prog, optarg);
+                    return 1;
+                }
+                break;
+            case OPT_ADSR:
+                // note envelope
+                if (sscanf(optarg, "%f,%f,%f,%f", &c.attack, &c.decay, &c.sustain, &c.release) != 4
+                        || c.attack < 0 || c.decay < 0 || c.release < 0
+                        || c.sustain < 0 || c.sustain > 1)
+                {
+                    fprintf(stderr, "%s: error: --adsr takes four numbers: attack, decay and release\n"
+                            "in milliseconds and a sustain level from 0 to 1\n", prog);
+                    return 1;
+                }
+                c.attack /= 1000;
+                c.decay /= 1000;
+                c.release /= 1000;
+                c.envelope = 1;
+                break;
+            case OPT_LIMIT:
+                // look-ahead limiter
+                c.limit = 1;
+                break;
+            case OPT_PREVIEW:
+                // quick draft
+                c.preview = 1;
+                break;
+            case OPT_NORMALIZE:
+                // volume from the notes
+                if (strcmp(optarg, "peak") == 0)
+                    c.normalize = NORMALIZE_PEAK;
+                else if (strcmp(optarg, "rms") == 0)
+                    c.normalize = NORMALIZE_RMS;
+                else
+                {
+                    fprintf(stderr, "%s: error: unknown --normalize '%s'\n", prog, optarg);
+                    return 1;
+                }
+                break;
+            case OPT_PRINT_DISPATCH:
+                // kernel build in use
+                printf("kernels: %s\n", dispatch_level());
+                return 0;
+            case OPT_VERIFY:
+                // check the render paths
+                c.verify = 1;
+                break;
+            case OPT_BENCH:
+                // benchmark
+                bench(stdout, sr);
+                bench_output(stdout, c.block_size);
+                return 0;
+            case 'S':
+                // spectrogram mode
+                c.mode = MODE_SPECTROGRAM;
+                break;
+            case 'N':
+                // spectrogram FFT size
+                if (atoi(optarg) <= 0)
+                {
+                    fprintf(stderr, "%s: error: -N argument must be greater than zero\n", prog);
+                    return 1;
+                }
+                c.fft_size = atoi(optarg);
+                break;
+            case 'H':
+                // spectrogram hop size
+                c.hop = atoi(optarg);
+                if (!c.hop)
+                {
+                    fprintf(stderr, "%s: error: -H argument must be greater than zero\n", prog);
+                    return 1;
+                }
+                break;
             default:
                 return 1;
         }
     }
     // get required file input
-    if (argc - optind < 1)
+    if (argc - optind < 1 && !c.verify)
     {
         fprintf(stderr, "%s: error: missing required arguments\n", prog);
         print_usage(stderr, prog);
         return 1;
     }
     in_filename = argv[optind];
+    if (c.preview && sr < PREVIEW_DIVISOR)
+    {
+        fprintf(stderr, "%s: error: -r argument %d is too low to preview at a %dth of it\n",
+                prog, sr, PREVIEW_DIVISOR);
+        return 1;
+    }
     // run!
-    unsigned int spp = calc_spp(sr, ppm); // samples per pixel
-    if (!out_filename)
+    c.rate = sr;
+    c.spp = calc_spp(sr, ppm); // samples per pixel
+    c.ox = x;
+    c.oy = y;
+    c.v = v;
+    if (container < 0)
+    {
+        size_t len = out_filename? strlen(out_filename) : 0;
+        container = CONTAINER_RAW;
+        if (len > 4 && strcasecmp(out_filename + len - 4, ".wav") == 0)
+            container = CONTAINER_WAV;
+        if (len > 5 && strcasecmp(out_filename + len - 5, ".flac") == 0)
+            container = CONTAINER_FLAC;
+    }
+    c.container = container;
+    if (!c.hop)
+        c.hop = c.fft_size / 4;
+    if (c.preview)
+    {
+        // far fewer samples, none of them dearer than in a full render
+        c.preview = PREVIEW_DIVISOR * c.oversample;
+        c.rate = sr / PREVIEW_DIVISOR;
+        c.spp = calc_spp(c.rate, ppm);
+        c.bandlimit = 0;
+        c.oversample = 1;
+    }
+    if (!out_filename && !c.verify)
+    {
+        printf("audio samples per pixel: %d\n", c.spp);
+    }
+    if (c.verify)
     {
-        printf("audio samples per pixel: %d\n", spp);
+        // the files given, or the example.png next to the program, then a
+        // sweep of every key
+        printf("kernels: %s\n", dispatch_level());
+        int err = 0;
+        if (optind == argc)
+        {
+            const char *slash = strrchr(argv[0], '/');
+            char example[PATH_MAX];
+            snprintf(example, sizeof(example), "%.*sexample.png",
+                    slash? (int)(slash - argv[0] + 1) : 0, argv[0]);
+            if (access(example, R_OK))
+            {
+                fprintf(stderr, "%s: error: could not find %s to verify, give an image instead\n",
+                        prog, example);
+                return 1;
+            }
+            err |= process(example, NULL, &c);
+        }
+        for (int i = optind; i < argc; i++)
+            err |= process(argv[i], NULL, &c);
+        struct score sweep;
+        if (score_sweep(&sweep, 64))
+            return 1;
+        err |= verify(stdout, "every key and waveform", &sweep, &c);
+        score_free(&sweep);
+        return err;
     }
-    return process(in_filename, out_filename, sr, spp, x, y, v);
+    return process(in_filename, out_filename, &c);
 }
 